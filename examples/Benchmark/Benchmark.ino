@@ -0,0 +1,221 @@
+// Measures the ESPConnect calls made the most often by applications and by the captive portal.
+//
+// Results are printed once as JSON, in the same shape as Google Benchmark (benchmarks[].name, iterations, real_time, time_unit),
+// with 2 more figures per benchmark:
+// - allocations: C++ allocations (operator new) per iteration, counted in all tasks while the benchmark runs
+// - heap_blocks: heap blocks still allocated after the benchmark compared to before it (should be 0)
+//
+// Run it on an idle network to compare builds: connected to a WiFi, or with the captive portal started.
+// The scan benchmarks serialize the scan cache as it is when the benchmarks start (scan_entries in the report):
+// it is filled when the captive portal is started.
+// pmk_self_test in the report checks the WPA2 PMK derivation (PMK cache, fast wake) against the IEEE 802.11i test vector.
+//
+// This sketch uses the ArduinoJson 7 API.
+#include <ESP32Connect.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+
+#if ARDUINOJSON_VERSION_MAJOR == 6
+  #error "The Benchmark example requires ArduinoJson 7"
+#endif
+
+namespace Soylent {
+  // friend of ESPConnect: reaches the internals of the captive portal measured here
+  struct ESPConnectBenchmark {
+      static bool derivePMK(const std::string& ssid, const std::string& password, std::string& pmk) { return ESPConnect::_derivePMK(ssid, password, pmk); }
+      static int8_t wifiSignalQuality(int32_t rssi) { return ESPConnect::_wifiSignalQuality(rssi); }
+      // body of the /espconnect/scan response, from a copy of the scan cache as in the handler
+      static size_t scanToJson(const ESPConnect& espConnect, const JsonArray& root) {
+        ESPConnect::ScanEntry entries[ESPCONNECT_SCAN_CACHE_SIZE];
+        uint32_t cachedAt;
+        const int count = espConnect._copyScanCache(entries, cachedAt);
+        if (count > 0)
+          ESPConnect::_scanToJson(root, entries, count);
+        return count > 0 ? count : 0;
+      }
+      // /espconnect/connect form, parsed into the configuration handed to loop()
+      static bool parsePortalForm(const char* apMode, const char* ssid, const char* password) {
+        ESPConnect::PortalConfig config;
+        return ESPConnect::_parsePortalForm(apMode, ssid, password, config) == nullptr;
+      }
+      static std::unique_ptr<AsyncWebServerResponse> beginPortalPage() { return ESPConnect::_beginPortalPage(); }
+  };
+} // namespace Soylent
+
+AsyncWebServer server(80);
+Soylent::ESPConnect espConnect(server);
+const char* hostname = "arduino-1";
+bool done = false;
+
+static std::atomic<uint32_t> allocations{0};
+static volatile uint32_t sink = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size);
+  if (p == nullptr)
+    abort();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, __unused size_t size) noexcept { free(p); }
+void operator delete[](void* p, __unused size_t size) noexcept { free(p); }
+
+template <typename F>
+void bench(JsonArray results, const char* name, uint32_t iterations, F&& fn) {
+  // warm up: lazy initializations are not measured
+  fn(0);
+
+  multi_heap_info_t before;
+  heap_caps_get_info(&before, MALLOC_CAP_DEFAULT);
+  const uint32_t allocationsBefore = allocations;
+  const int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < iterations; i++)
+    fn(i);
+  const int64_t elapsed = esp_timer_get_time() - start;
+  const uint32_t allocated = allocations - allocationsBefore;
+  multi_heap_info_t after;
+  heap_caps_get_info(&after, MALLOC_CAP_DEFAULT);
+
+  JsonObject result = results.add<JsonObject>();
+  result["name"] = name;
+  result["iterations"] = iterations;
+  result["real_time"] = static_cast<double>(elapsed) * 1000 / iterations;
+  result["time_unit"] = "ns";
+  result["allocations"] = static_cast<float>(allocated) / iterations;
+  result["heap_blocks"] = static_cast<int32_t>(after.allocated_blocks) - static_cast<int32_t>(before.allocated_blocks);
+}
+
+void runBenchmarks() {
+  JsonDocument report;
+  report["version"] = ESPCONNECT_VERSION;
+  report["state"] = espConnect.getStateName();
+  report["cpu_mhz"] = getCpuFrequencyMhz();
+  JsonDocument scan;
+  report["scan_entries"] = Soylent::ESPConnectBenchmark::scanToJson(espConnect, scan.to<JsonArray>());
+  // IEEE 802.11i-2004, H.4.1: passphrase "password", SSID "IEEE"
+  std::string pmk;
+  report["pmk_self_test"] = Soylent::ESPConnectBenchmark::derivePMK("IEEE", "password", pmk) && pmk == "f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e";
+  JsonArray results = report["benchmarks"].to<JsonArray>();
+
+  bench(results, "toJson", 200, [](__unused uint32_t i) {
+    JsonDocument doc;
+    espConnect.toJson(doc.to<JsonObject>());
+    sink = sink + doc.size();
+  });
+
+  bench(results, "toJson/serialize", 200, [](__unused uint32_t i) {
+    static char buffer[2048];
+    JsonDocument doc;
+    espConnect.toJson(doc.to<JsonObject>());
+    sink = sink + serializeJson(doc, buffer, sizeof(buffer));
+  });
+
+  bench(results, "getStateName", 10000, [](uint32_t i) {
+    const auto state = static_cast<Soylent::ESPConnect::State>(i % (static_cast<uint32_t>(Soylent::ESPConnect::State::PORTAL_TIMEOUT) + 1));
+    sink = sink + espConnect.getStateName(state)[0];
+  });
+
+  bench(results, "getMACAddress/STA", 1000, [](__unused uint32_t i) {
+    sink = sink + espConnect.getMACAddress(Soylent::ESPConnect::Mode::STA).length();
+  });
+
+  bench(results, "getMACAddress/AP", 1000, [](__unused uint32_t i) {
+    sink = sink + espConnect.getMACAddress(Soylent::ESPConnect::Mode::AP).length();
+  });
+
+  bench(results, "getWiFiSignalQuality", 1000, [](__unused uint32_t i) {
+    sink = sink + espConnect.getWiFiSignalQuality();
+  });
+
+  bench(results, "getConfig", 1000, [](__unused uint32_t i) {
+    sink = sink + espConnect.getConfig().wifiSSID.length();
+  });
+
+  bench(results, "getTrafficStats", 1000, [](__unused uint32_t i) {
+    sink = sink + espConnect.getTrafficStats(Soylent::ESPConnect::Mode::STA).rxPackets;
+  });
+
+  // below, in and above the mapped range (-90 to -30 dBm)
+  bench(results, "wifiSignalQuality/rssi:-120..-91", 10000, [](uint32_t i) {
+    sink = sink + Soylent::ESPConnectBenchmark::wifiSignalQuality(-120 + static_cast<int32_t>(i % 30));
+  });
+
+  bench(results, "wifiSignalQuality/rssi:-90..-30", 10000, [](uint32_t i) {
+    sink = sink + Soylent::ESPConnectBenchmark::wifiSignalQuality(-90 + static_cast<int32_t>(i % 61));
+  });
+
+  bench(results, "wifiSignalQuality/rssi:-29..0", 10000, [](uint32_t i) {
+    sink = sink + Soylent::ESPConnectBenchmark::wifiSignalQuality(-29 + static_cast<int32_t>(i % 30));
+  });
+
+  // body of the /espconnect/scan response
+  bench(results, "scanToJson", 200, [](__unused uint32_t i) {
+    JsonDocument doc;
+    sink = sink + Soylent::ESPConnectBenchmark::scanToJson(espConnect, doc.to<JsonArray>());
+  });
+
+  bench(results, "scanToJson/serialize", 200, [](__unused uint32_t i) {
+    static char buffer[ESPCONNECT_SCAN_CACHE_SIZE * 128 + 2];
+    JsonDocument doc;
+    Soylent::ESPConnectBenchmark::scanToJson(espConnect, doc.to<JsonArray>());
+    sink = sink + serializeJson(doc, buffer, sizeof(buffer));
+  });
+
+  // parsing of the /espconnect/connect form (ap_mode, validation, copy of the credentials), cycling through accepted and rejected forms.
+  // The lookup of the form parameters in the request is done by ESPAsyncWebServer and is not measured.
+  bench(results, "parsePortalForm", 10000, [](uint32_t i) {
+    static const char* const forms[][3] = {
+      {"", "Access Point", "password1234"},
+      {"", "Open Access Point", ""},
+      {"true", "", ""},
+      {"", "", "password1234"},
+      {"", "Access Point", "short"},
+      {"", "Access Point With A Name Longer Than 32 Characters", "password1234"},
+    };
+    const char* const* form = forms[i % (sizeof(forms) / sizeof(forms[0]))];
+    sink = sink + Soylent::ESPConnectBenchmark::parsePortalForm(form[0], form[1], form[2]);
+  });
+
+  // response of / and of the captive portal redirects, deleted instead of sent
+  bench(results, "beginPortalPage", 1000, [](__unused uint32_t i) {
+    sink = sink + (Soylent::ESPConnectBenchmark::beginPortalPage() != nullptr);
+  });
+
+  // 4096 HMAC-SHA1 rounds: run once per credentials, in its own task
+  bench(results, "derivePMK", 5, [](__unused uint32_t i) {
+    std::string pmk;
+    Soylent::ESPConnectBenchmark::derivePMK("IEEE", "password", pmk);
+    sink = sink + pmk.length();
+  });
+
+  serializeJsonPretty(report, Serial);
+  Serial.println();
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    continue;
+
+  espConnect.setAutoRestart(false);
+  espConnect.setBlocking(false);
+  espConnect.begin(hostname, "Captive Portal SSID");
+}
+
+void loop() {
+  espConnect.loop();
+
+  // measure once the state machine has settled
+  if (!done && (espConnect.getState() == Soylent::ESPConnect::State::NETWORK_CONNECTED || espConnect.getState() == Soylent::ESPConnect::State::PORTAL_STARTED)) {
+    done = true;
+    runBenchmarks();
+  }
+}
@@ -0,0 +1,86 @@
+// Stress test of the configuration snapshots: two tasks publish IP configurations with setIPConfig()
+// while two other tasks read them with getIPConfig() and getConfig(), without pause.
+//
+// The 4 addresses of each published IP configuration are set to the same value: a reader seeing different addresses got a torn snapshot.
+// The configuration version seen by a reader must never go backwards.
+// Counts are printed every 5 seconds: torn and version_errors must stay at 0.
+//
+// ESPConnect is not started: the IP configurations written here would otherwise be used to connect.
+#include <ESP32Connect.h>
+
+#include <atomic>
+
+AsyncWebServer server(80);
+Soylent::ESPConnect espConnect(server);
+uint32_t lastLog = 0;
+
+static std::atomic<uint32_t> writes{0};
+static std::atomic<uint32_t> reads{0};
+static std::atomic<uint32_t> torn{0};
+static std::atomic<uint32_t> versionErrors{0};
+
+static void writer(void* arg) {
+  // odd and even values: the 2 writers never publish the same configuration
+  uint32_t value = reinterpret_cast<uintptr_t>(arg);
+  while (true) {
+    for (int i = 0; i < 100; i++) {
+      Soylent::ESPConnect::IPConfig ipConfig;
+      ipConfig.ip = IPAddress(value);
+      ipConfig.subnet = IPAddress(value);
+      ipConfig.gateway = IPAddress(value);
+      ipConfig.dns = IPAddress(value);
+      espConnect.setIPConfig(ipConfig);
+      value += 2;
+      writes++;
+    }
+    // let the idle task run
+    vTaskDelay(1);
+  }
+}
+
+static void reader(__unused void* arg) {
+  uint32_t lastVersion = 0;
+  while (true) {
+    for (int i = 0; i < 1000; i++) {
+      const uint32_t version = espConnect.getConfigVersion();
+      const Soylent::ESPConnect::IPConfig ipConfig = espConnect.getIPConfig();
+      if (!(ipConfig.subnet == ipConfig.ip && ipConfig.gateway == ipConfig.ip && ipConfig.dns == ipConfig.ip))
+        torn++;
+      if (version < lastVersion)
+        versionErrors++;
+      lastVersion = version;
+      // copies the strings of the same snapshots
+      const Soylent::ESPConnect::Config config = espConnect.getConfig();
+      if (config.apMode && !config.wifiSSID.empty())
+        torn++;
+      reads++;
+    }
+    vTaskDelay(1);
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    continue;
+
+  xTaskCreate(writer, "writer-0", 4096, reinterpret_cast<void*>(0), 1, nullptr);
+  xTaskCreate(writer, "writer-1", 4096, reinterpret_cast<void*>(1), 1, nullptr);
+  xTaskCreate(reader, "reader-0", 4096, nullptr, 1, nullptr);
+  xTaskCreate(reader, "reader-1", 4096, nullptr, 1, nullptr);
+}
+
+void loop() {
+  if (millis() - lastLog > 5000) {
+    JsonDocument doc;
+    doc["writes"] = writes.load();
+    doc["reads"] = reads.load();
+    doc["torn"] = torn.load();
+    doc["version_errors"] = versionErrors.load();
+    doc["config_version"] = espConnect.getConfigVersion();
+    serializeJson(doc, Serial);
+    Serial.println();
+    lastLog = millis();
+  }
+  delay(100);
+}
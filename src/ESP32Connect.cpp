@@ -4,16 +4,41 @@
  */
 #include "ESP32Connect.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
 
 #ifndef ESPCONNECT_NO_MDNS
   #include <ESPmDNS.h>
 #endif
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
 #include <esp_mac.h>
+#include <esp_netif.h>
+#include <esp_system.h>
+#include <lwip/dhcp.h>
+#include <lwip/dns.h>
+#include <lwip/netif.h>
+#include <lwip/pbuf.h>
+#include <lwip/stats.h>
+#include <lwip/tcpip.h>
+#include <lwip/udp.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+#include <mbedtls/version.h>
+#include <ping/ping_sock.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <time.h>
+
+#ifdef ESPCONNECT_ETH_SUPPORT
+  #include <ETH.h>
+#endif
 
 #include <Preferences.h>
 #include <functional>
+#include <new>
 
 #include "./espconnect_webpage.h"
 
@@ -56,6 +81,269 @@ static const char* NetworkStateNames[] = {
   "PORTAL_TIMEOUT",
 };
 
+#define WAKE_CACHE_MAGIC 0x45435731 // ECW1
+
+// connection retained across deep sleep: the passphrase is not kept, only the PMK derived from it
+typedef struct {
+    uint32_t magic;
+    // hash of the hostname and static IP configuration the entry was made for
+    uint32_t hash;
+    // pmkId() of the credentials the entry was made for
+    uint32_t credentials;
+    char ssid[33];
+    // 64 hex digits PMK, empty for an open network
+    char pmk[65];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    // RTC time (s) until which the DHCP lease can be reused, 0 if none
+    time_t leaseExpiry;
+} WakeCache;
+
+RTC_DATA_ATTR static WakeCache wakeCache;
+
+// FNV-1a
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+static uint32_t wakeHash(const char* hostname, const Soylent::ESPConnect::IPConfig& ipConfig) {
+  uint32_t hash = fnv1a(2166136261UL, hostname, strlen(hostname) + 1);
+  const uint32_t ips[] = {ipConfig.ip, ipConfig.gateway, ipConfig.subnet, ipConfig.dns};
+  return fnv1a(hash, ips, sizeof(ips));
+}
+
+// identifies the credentials a stored PMK was derived from
+static uint32_t pmkId(const std::string& ssid, const std::string& password) {
+  return fnv1a(fnv1a(2166136261UL, ssid.c_str(), ssid.length() + 1), password.c_str(), password.length() + 1);
+}
+
+static void removePMK() {
+  Preferences preferences;
+  preferences.begin("ESPConnect", false);
+  preferences.remove("pmk");
+  preferences.remove("pmk_id");
+  preferences.end();
+}
+
+// the PMK replaces the passphrase only with WPA/WPA2-PSK: WPA3-SAE (including the WPA2/WPA3 transition mode) derives its own keys
+static bool pmkSupported() {
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+    return false;
+  return ap.authmode == WIFI_AUTH_WPA_PSK || ap.authmode == WIFI_AUTH_WPA2_PSK || ap.authmode == WIFI_AUTH_WPA_WPA2_PSK;
+}
+
+bool Soylent::ESPConnect::_derivePMK(const std::string& ssid, const std::string& password, std::string& pmk) {
+  uint8_t key[32];
+  const uint8_t* pass = reinterpret_cast<const uint8_t*>(password.c_str());
+  const uint8_t* salt = reinterpret_cast<const uint8_t*>(ssid.c_str());
+#if MBEDTLS_VERSION_NUMBER >= 0x03030000 // mbedtls_pkcs5_pbkdf2_hmac() is deprecated since 3.3
+  if (mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, pass, password.length(), salt, ssid.length(), 4096, sizeof(key), key) != 0)
+    return false;
+#else
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  int err = mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1);
+  if (err == 0)
+    err = mbedtls_pkcs5_pbkdf2_hmac(&ctx, pass, password.length(), salt, ssid.length(), 4096, sizeof(key), key);
+  mbedtls_md_free(&ctx);
+  if (err != 0)
+    return false;
+#endif
+  char hex[sizeof(key) * 2 + 1];
+  for (size_t i = 0; i < sizeof(key); i++)
+    snprintf(hex + i * 2, 3, "%02x", key[i]);
+  pmk = hex;
+  return true;
+}
+
+// worst case duration (ms) of a full scan: the active dwell time on each channel of the configured country
+static uint32_t scanDuration() {
+  wifi_country_t country;
+  const uint8_t channels = esp_wifi_get_country(&country) == ESP_OK && country.nchan > 0 ? country.nchan : 14;
+  return ESPCONNECT_SCAN_DWELL * channels;
+}
+
+static bool wakeCacheValid(const char* hostname, const Soylent::ESPConnect::IPConfig& ipConfig) {
+  return esp_reset_reason() == ESP_RST_DEEPSLEEP && wakeCache.magic == WAKE_CACHE_MAGIC && wakeCache.hash == wakeHash(hostname, ipConfig);
+}
+
+static Soylent::ESPConnect::Config loadConfig() {
+  LOGD(TAG, "Loading config...");
+  Preferences preferences;
+  preferences.begin("ESPConnect", true);
+  std::string ssid;
+  std::string password;
+  if (preferences.isKey("ssid"))
+    ssid = preferences.getString("ssid").c_str();
+  if (preferences.isKey("password"))
+    password = preferences.getString("password").c_str();
+  bool ap = preferences.isKey("ap") ? preferences.getBool("ap", false) : false;
+  preferences.end();
+  LOGD(TAG, " - AP: %d", ap);
+  LOGD(TAG, " - SSID: %s", ssid.c_str());
+  return {ssid, password, ap};
+}
+
+// lease time (s) offered by the DHCP server of the STA interface, 0 if unknown
+static uint32_t dhcpLeaseTime() {
+  esp_netif_t* netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  if (netif == nullptr)
+    return 0;
+  struct netif* lwip = static_cast<struct netif*>(esp_netif_get_netif_impl(netif));
+  if (lwip == nullptr)
+    return 0;
+  struct dhcp* dhcp = netif_dhcp_data(lwip);
+  return dhcp == nullptr ? 0 : dhcp->offered_t0_lease;
+}
+
+// traffic counters of the STA (0) and ETH (1) netifs.
+// The wrapped input runs in the driver task and the wrapped linkoutput in the lwIP thread: each counter has a single writer.
+struct TrafficHook {
+    struct netif* netif;
+    netif_input_fn input;
+    netif_linkoutput_fn linkoutput;
+    std::atomic<uint32_t> rxBytes;
+    std::atomic<uint32_t> txBytes;
+    std::atomic<uint32_t> rxPackets;
+    std::atomic<uint32_t> txPackets;
+    std::atomic<uint32_t> rxDrops;
+    std::atomic<uint32_t> txDrops;
+};
+static TrafficHook trafficHooks[2];
+
+static err_t trafficInput(struct pbuf* p, struct netif* netif) {
+  TrafficHook& hook = trafficHooks[trafficHooks[0].netif == netif ? 0 : 1];
+  // the pbuf belongs to the stack once accepted
+  const uint16_t len = p->tot_len;
+  const err_t err = hook.input(p, netif);
+  if (err == ERR_OK) {
+    hook.rxPackets.fetch_add(1, std::memory_order_relaxed);
+    hook.rxBytes.fetch_add(len, std::memory_order_relaxed);
+  } else {
+    hook.rxDrops.fetch_add(1, std::memory_order_relaxed);
+  }
+  return err;
+}
+
+static err_t trafficOutput(struct netif* netif, struct pbuf* p) {
+  TrafficHook& hook = trafficHooks[trafficHooks[0].netif == netif ? 0 : 1];
+  const err_t err = hook.linkoutput(netif, p);
+  if (err == ERR_OK) {
+    hook.txPackets.fetch_add(1, std::memory_order_relaxed);
+    hook.txBytes.fetch_add(p->tot_len, std::memory_order_relaxed);
+  } else {
+    hook.txDrops.fetch_add(1, std::memory_order_relaxed);
+  }
+  return err;
+}
+
+static struct netif* lwipNetif(const char* ifkey) {
+  esp_netif_t* netif = esp_netif_get_handle_from_ifkey(ifkey);
+  return netif == nullptr ? nullptr : static_cast<struct netif*>(esp_netif_get_netif_impl(netif));
+}
+
+// runs in the lwIP thread: wraps the netifs not wrapped yet, including re-created ones
+static void hookTraffic(__unused void* ctx) {
+  struct netif* netifs[2] = {lwipNetif("WIFI_STA_DEF"), nullptr};
+#ifdef ESPCONNECT_ETH_SUPPORT
+  netifs[1] = lwipNetif("ETH_DEF");
+  // Arduino 3 names the Ethernet interfaces by index
+  if (netifs[1] == nullptr)
+    netifs[1] = lwipNetif("ETH_0");
+#endif
+  for (size_t i = 0; i < 2; i++) {
+    struct netif* netif = netifs[i];
+    if (netif == nullptr || netif->input == trafficInput)
+      continue;
+    trafficHooks[i].netif = netif;
+    trafficHooks[i].input = netif->input;
+    trafficHooks[i].linkoutput = netif->linkoutput;
+    netif->input = trafficInput;
+    netif->linkoutput = trafficOutput;
+  }
+}
+
+// runs in the lwIP thread, queued before the interfaces are torn down.
+// The hook keeps its netif: a frame already inside a wrapper still finds its original functions.
+static void unhookTraffic(__unused void* ctx) {
+  for (TrafficHook& hook : trafficHooks) {
+    if (hook.netif == nullptr || hook.netif->input != trafficInput)
+      continue;
+    hook.netif->input = hook.input;
+    hook.netif->linkoutput = hook.linkoutput;
+  }
+}
+
+static uint32_t perSecond(uint32_t delta, uint32_t elapsedMs) {
+  return elapsedMs == 0 ? 0 : static_cast<uint32_t>(static_cast<uint64_t>(delta) * 1000 / elapsedMs);
+}
+
+static uint16_t perThousand(uint32_t count, uint32_t total) {
+  return total == 0 ? 0 : static_cast<uint16_t>(std::min<uint64_t>(1000, static_cast<uint64_t>(count) * 1000 / total));
+}
+
+static void trafficToJson(const JsonObject& root, const char* key, const Soylent::ESPConnect::TrafficStats& stats) {
+#if ARDUINOJSON_VERSION_MAJOR == 6
+  JsonObject entry = root.createNestedObject(key);
+#else
+  JsonObject entry = root[key].to<JsonObject>();
+#endif
+  entry["rx_bytes"] = stats.rxBytes;
+  entry["rx_bytes_rate"] = stats.rxBytesRate;
+  entry["rx_drop_rate"] = stats.rxDropRate;
+  entry["rx_drops"] = stats.rxDrops;
+  entry["rx_packets"] = stats.rxPackets;
+  entry["rx_packets_rate"] = stats.rxPacketsRate;
+  entry["tx_bytes"] = stats.txBytes;
+  entry["tx_bytes_rate"] = stats.txBytesRate;
+  entry["tx_drop_rate"] = stats.txDropRate;
+  entry["tx_drops"] = stats.txDrops;
+  entry["tx_packets"] = stats.txPackets;
+  entry["tx_packets_rate"] = stats.txPacketsRate;
+}
+
+// portal rejections are written straight to the connection from flash, without allocating a response
+static const char PortalBusyResponse[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char PortalRateResponse[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+static void rejectPortalRequest(AsyncWebServerRequest* request, const char* response, size_t len) {
+  // paused: the server does not send its own response, the request is freed when the connection closes
+  request->pause();
+  AsyncClient* client = request->client();
+  client->add(response, len, 0);
+  client->send();
+  client->setRxTimeout(1);
+}
+
+static const char* ModeName(Soylent::ESPConnect::Mode mode) {
+  switch (mode) {
+    case Soylent::ESPConnect::Mode::AP:
+      return "AP";
+    case Soylent::ESPConnect::Mode::STA:
+      return "STA";
+    case Soylent::ESPConnect::Mode::ETH:
+      return "ETH";
+    default:
+      return "NONE";
+  }
+}
+
+static const char* PowerModeNames[] = {
+  "NONE",
+  "MIN_MODEM",
+  "MAX_MODEM",
+};
+
 const char* Soylent::ESPConnect::getStateName() const {
   return NetworkStateNames[static_cast<int>(_state)];
 }
@@ -73,9 +361,7 @@ Soylent::ESPConnect::Mode Soylent::ESPConnect::getMode() const {
     case Soylent::ESPConnect::State::NETWORK_CONNECTED:
     case Soylent::ESPConnect::State::NETWORK_DISCONNECTED:
     case Soylent::ESPConnect::State::NETWORK_RECONNECTING:
-      if (WiFi.localIP()[0] != 0)
-        return Soylent::ESPConnect::Mode::STA;
-      return Soylent::ESPConnect::Mode::NONE;
+      return _failoverMode();
     default:
       return Soylent::ESPConnect::Mode::NONE;
   }
@@ -91,6 +377,11 @@ std::string Soylent::ESPConnect::getMACAddress(Soylent::ESPConnect::Mode mode) c
     case Soylent::ESPConnect::Mode::STA:
       mac = WiFi.macAddress().c_str();
       break;
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case Soylent::ESPConnect::Mode::ETH:
+      mac = ETH.macAddress().c_str();
+      break;
+#endif
     default:
       break;
   }
@@ -108,6 +399,11 @@ std::string Soylent::ESPConnect::getMACAddress(Soylent::ESPConnect::Mode mode) c
     case Soylent::ESPConnect::Mode::STA:
       type = ESP_MAC_WIFI_STA;
       break;
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case Soylent::ESPConnect::Mode::ETH:
+      type = ESP_MAC_ETH;
+      break;
+#endif
     default:
       break;
   }
@@ -131,6 +427,10 @@ IPAddress Soylent::ESPConnect::getIPAddress(Soylent::ESPConnect::Mode mode) cons
       return wifiMode == WIFI_MODE_AP || wifiMode == WIFI_MODE_APSTA ? WiFi.softAPIP() : IPAddress();
     case Soylent::ESPConnect::Mode::STA:
       return wifiMode == WIFI_MODE_STA ? WiFi.localIP() : IPAddress();
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case Soylent::ESPConnect::Mode::ETH:
+      return ETH.linkUp() ? ETH.localIP() : IPAddress();
+#endif
     default:
       return IPAddress();
   }
@@ -142,12 +442,57 @@ std::string Soylent::ESPConnect::getWiFiSSID() const {
     case WIFI_MODE_APSTA:
       return _apSSID;
     case WIFI_MODE_STA:
-      return _config.wifiSSID;
+      return getConfig().wifiSSID;
     default:
       return {};
   }
 }
 
+Soylent::ESPConnect::Config Soylent::ESPConnect::getConfig() const {
+  uint8_t slot;
+  const Soylent::ESPConnect::Config config = _acquireSnapshot(slot).config;
+  _releaseSnapshot(slot);
+  return config;
+}
+
+Soylent::ESPConnect::IPConfig Soylent::ESPConnect::getIPConfig() const {
+  uint8_t slot;
+  const Soylent::ESPConnect::IPConfig ipConfig = _acquireSnapshot(slot).ipConfig;
+  _releaseSnapshot(slot);
+  return ipConfig;
+}
+
+void Soylent::ESPConnect::setIPConfig(const Soylent::ESPConnect::IPConfig& ipConfig) {
+  Lock lock(this);
+  Lock configLock(_configMutex);
+  _ipConfig = ipConfig;
+  _publishConfig();
+}
+
+const Soylent::ESPConnect::ConfigSnapshot& Soylent::ESPConnect::_acquireSnapshot(uint8_t& slot) const {
+  while (true) {
+    slot = _snapshot.load();
+    _snapshotReaders[slot]++;
+    // still published after being pinned: the writer won't touch it until released
+    if (_snapshot.load() == slot)
+      return _snapshots[slot];
+    _snapshotReaders[slot]--;
+  }
+}
+
+// Called with the working copies in a consistent state and _configMutex held.
+// Never called from the async_tcp task: the portal hands its configuration to loop().
+void Soylent::ESPConnect::_publishConfig() {
+  const uint8_t slot = _snapshot.load() ^ 1;
+  // readers still copying the previous snapshot from this slot: they only hold it for the duration of a copy
+  while (_snapshotReaders[slot].load() != 0)
+    vTaskDelay(1);
+  _snapshots[slot].config = _config;
+  _snapshots[slot].ipConfig = _ipConfig;
+  _snapshot.store(slot);
+  _configVersion++;
+}
+
 std::string Soylent::ESPConnect::getWiFiBSSID() const {
   switch (WiFi.getMode()) {
     case WIFI_MODE_AP:
@@ -181,21 +526,16 @@ void Soylent::ESPConnect::begin(const char* hostname,
 
   _autoSave = true;
 
-  LOGD(TAG, "Loading config...");
-  Preferences preferences;
-  preferences.begin("ESPConnect", true);
-  std::string ssid;
-  std::string password;
-  if (preferences.isKey("ssid"))
-    ssid = preferences.getString("ssid").c_str();
-  if (preferences.isKey("password"))
-    password = preferences.getString("password").c_str();
-  bool ap = preferences.isKey("ap") ? preferences.getBool("ap", false) : false;
-  preferences.end();
-  LOGD(TAG, " - AP: %d", ap);
-  LOGD(TAG, " - SSID: %s", ssid.c_str());
+  // woken up from deep sleep with a retained connection ? skip NVS: connect with the retained PMK,
+  // the config is loaded once connected (or when the retained connection fails) and checked against it
+  if (_fastWake && wakeCacheValid(hostname, _ipConfig)) {
+    LOGD(TAG, "Using connection retained in RTC memory");
+    _configDeferred = true;
+    begin(hostname, apSSID, apPassword, {wakeCache.ssid, "", false});
+    return;
+  }
 
-  begin(hostname, apSSID, apPassword, {ssid, password, ap});
+  begin(hostname, apSSID, apPassword, loadConfig());
 }
 
 void Soylent::ESPConnect::begin(const char* hostname,
@@ -208,14 +548,76 @@ void Soylent::ESPConnect::begin(const char* hostname,
   _hostname = hostname;
   _apSSID = apSSID;
   _apPassword = apPassword;
+  Lock configLock(_configMutex);
   _config = config; // copy values
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+  // credentials saved from the portal later fit without reallocating
+  _config.wifiSSID.reserve(32);
+  _config.wifiPassword.reserve(64);
+  for (Soylent::ESPConnect::ConfigSnapshot& snapshot : _snapshots) {
+    snapshot.config.wifiSSID.reserve(32);
+    snapshot.config.wifiPassword.reserve(64);
+  }
+#endif
+  _publishConfig();
+#ifdef ESPCONNECT_TRACE
+  clearTrace();
+  _traceHeader.flags = (_config.apMode ? Soylent::ESPConnect::TraceHeader::AP_MODE : 0) | (_config.wifiSSID.empty() ? 0 : Soylent::ESPConnect::TraceHeader::WIFI_SSID) | (_backgroundRetry ? Soylent::ESPConnect::TraceHeader::BACKGROUND_RETRY : 0);
+  _traceHeader.connectTimeout = std::min<uint32_t>(_connectTimeout, UINT16_MAX);
+  _traceHeader.portalTimeout = std::min<uint32_t>(_portalTimeout, UINT16_MAX);
+#endif
+  _pmk.clear();
+  _pmkDerived = false;
+  _fastPath = _fastWake && !_config.apMode && wakeCacheValid(hostname, _ipConfig) && (_configDeferred || wakeCache.credentials == pmkId(_config.wifiSSID, _config.wifiPassword));
+  if (_fastPath) {
+    _pmk = wakeCache.pmk;
+    _pmkDerived = true;
+  } else if (_pmkCache && _autoSave && !_config.wifiPassword.empty()) {
+    Preferences preferences;
+    preferences.begin("ESPConnect", true);
+    // only valid for the credentials it was derived from
+    if (preferences.isKey("pmk") && preferences.getUInt("pmk_id", 0) == pmkId(_config.wifiSSID, _config.wifiPassword))
+      _pmk = preferences.getString("pmk").c_str();
+    preferences.end();
+    _pmkDerived = !_pmk.empty();
+  }
+  _timers.reset(_now());
+  _powerModeSince = _now();
+
+  if (_taskMode) {
+    if (_mutex == nullptr)
+      _mutex = xSemaphoreCreateRecursiveMutex();
+    if (_events == nullptr)
+      _events = xQueueCreate(ESPCONNECT_TASK_QUEUE_SIZE, sizeof(arduino_event_id_t));
+  }
 
   _wifiEventListenerId = WiFi.onEvent([&](arduino_event_id_t event, __unused arduino_event_info_t info) {
-    ESPConnect::_onWiFiEvent(event);
+    _eventTask = xTaskGetCurrentTaskHandle();
+    if (_taskMode) {
+      // handled by the ESPConnect task: the event task must never wait on the state machine,
+      // which itself waits on the event task in some WiFi calls
+      QueueHandle_t events = _events;
+      if (events != nullptr && xQueueSend(events, &event, 0) != pdTRUE) {
+        LOGW(TAG, "WiFi event %d dropped", event);
+      }
+      _wake();
+    } else {
+      ESPConnect::_onWiFiEvent(event);
+    }
   });
 
   _state = Soylent::ESPConnect::State::NETWORK_ENABLED;
 
+  if (_taskMode) {
+    _taskStop = false;
+    TaskHandle_t task = nullptr;
+    if (xTaskCreatePinnedToCore(_runTask, "espconnect", _taskStackSize, this, _taskPriority, &task, _taskCore) == pdPASS) {
+      _task = task;
+    } else {
+      LOGE(TAG, "Failed to create ESPConnect task");
+    }
+  }
+
   // blocks like the old behaviour
   if (_blocking) {
     LOGI(TAG, "Starting ESPConnect in blocking mode...");
@@ -228,24 +630,246 @@ void Soylent::ESPConnect::begin(const char* hostname,
   }
 }
 
+Soylent::ESPConnect::ESPConnect(AsyncWebServer& httpd) : _httpd(&httpd), _configMutex(xSemaphoreCreateRecursiveMutex()) {}
+
+Soylent::ESPConnect::~ESPConnect() {
+  end();
+  // the PMK task writes its result here
+  while (_pmkDeriving && _pmkJob == nullptr)
+    delay(1);
+  delete _pmkJob.exchange(nullptr);
+  vSemaphoreDelete(_configMutex);
+}
+
+void Soylent::ESPConnect::listen(Soylent::ESPConnect::StateCallback callback) {
+  Lock lock(this);
+  _callback = callback;
+}
+
+void Soylent::ESPConnect::setClock(Soylent::ESPConnect::ClockSource clock) {
+  Lock lock(this);
+  _clock = clock;
+}
+
+void Soylent::ESPConnect::setReadinessProbe(Soylent::ESPConnect::ReadinessProbe probe, const char* host, uint16_t port) {
+  Lock lock(this);
+  _readinessProbe = probe;
+  _readinessHost = host == nullptr ? "" : host;
+  _readinessPort = port;
+}
+
+Soylent::ESPConnect::LinkStats Soylent::ESPConnect::getLinkStats() const {
+  Lock lock(this);
+  return _linkStats;
+}
+
+void Soylent::ESPConnect::setTaskMode(bool taskMode, BaseType_t core, UBaseType_t priority, uint32_t stackSize) {
+  if (_state != Soylent::ESPConnect::State::NETWORK_DISABLED)
+    return;
+  _taskMode = taskMode;
+  _taskCore = core;
+  _taskPriority = priority;
+  _taskStackSize = stackSize;
+}
+
+// Task mode: the task sleeps until the next timer is due, a WiFi event or a state change from another task wakes it up,
+// or at most ESPCONNECT_TASK_MAX_SLEEP ms. While the captive portal runs, the DNS server is polled every ESPCONNECT_TASK_DNS_PERIOD ms.
+void Soylent::ESPConnect::_runTask(void* arg) {
+  Soylent::ESPConnect* self = static_cast<Soylent::ESPConnect*>(arg);
+  self->_task = xTaskGetCurrentTaskHandle();
+  while (!self->_taskStop) {
+    self->loop();
+    uint32_t sleep;
+    {
+      Lock lock(self);
+      sleep = std::min<uint32_t>(self->_timers.msUntilNext(self->_now()), ESPCONNECT_TASK_MAX_SLEEP);
+      if (self->_dnsServer != nullptr)
+        sleep = std::min<uint32_t>(sleep, ESPCONNECT_TASK_DNS_PERIOD);
+    }
+    // timers only move by whole ticks
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(std::max<uint32_t>(sleep, ESPCONNECT_TIMER_TICK)));
+  }
+  // end() called from this task (i.e. from the state callback) already stopped everything: only the mutex is left
+  if (self->_state == Soylent::ESPConnect::State::NETWORK_DISABLED)
+    self->_deleteMutex();
+  self->_task = nullptr;
+  vTaskDelete(nullptr);
+}
+
+void Soylent::ESPConnect::_derivePMKTask(void* arg) {
+  PMKJob* job = static_cast<PMKJob*>(arg);
+  __unused const uint32_t start = millis();
+  job->derived = _derivePMK(job->ssid, job->password, job->pmk);
+  if (job->derived) {
+    LOGI(TAG, "PMK derived in %" PRIu32 " ms", millis() - start);
+  }
+  Soylent::ESPConnect* self = job->self;
+  self->_pmkJob = job;
+  self->_wake();
+  vTaskDelete(nullptr);
+}
+
+void Soylent::ESPConnect::_deleteMutex() {
+  SemaphoreHandle_t mutex = _mutex;
+  _mutex = nullptr;
+  if (mutex != nullptr)
+    vSemaphoreDelete(mutex);
+}
+
+void Soylent::ESPConnect::_wake() {
+  TaskHandle_t task = _task;
+  if (task != nullptr)
+    xTaskNotifyGive(task);
+}
+
+Soylent::ESPConnect::Lock::Lock(const Soylent::ESPConnect* espConnect) : Lock(espConnect->_mutex) {}
+
+Soylent::ESPConnect::Lock::Lock(SemaphoreHandle_t mutex) : mutex(mutex) {
+  if (mutex != nullptr)
+    xSemaphoreTakeRecursive(mutex, portMAX_DELAY);
+}
+
+Soylent::ESPConnect::Lock::~Lock() {
+  if (mutex != nullptr)
+    xSemaphoreGiveRecursive(mutex);
+}
+
 void Soylent::ESPConnect::end() {
   if (_state == Soylent::ESPConnect::State::NETWORK_DISABLED)
     return;
   LOGI(TAG, "Stopping ESPConnect...");
-  _lastTime = -1;
+  if (_task != nullptr) {
+    _taskStop = true;
+    // called from the ESPConnect task itself (i.e. from the state callback): it cannot wait for itself,
+    // the task exits when the current loop() returns and deletes the mutex
+    if (xTaskGetCurrentTaskHandle() == _task) {
+      Lock lock(this);
+      _teardown();
+      _httpd = nullptr;
+      // pending notification: the task does not sleep after this loop()
+      _wake();
+      return;
+    }
+    _wake();
+    while (_task != nullptr)
+      delay(1);
+  }
+
+  {
+    Lock lock(this);
+    _teardown();
+    _httpd = nullptr;
+  }
+  _deleteMutex();
+}
+
+// stops everything started since begin(), back to NETWORK_DISABLED
+void Soylent::ESPConnect::_teardown() {
+  _timers.reset(_now());
   _autoSave = false;
+  _activeMode = Soylent::ESPConnect::Mode::NONE;
+  _roamScanning = false;
+  _configDeferred = false;
+  _leaseReused = false;
   _setState(Soylent::ESPConnect::State::NETWORK_DISABLED);
-  WiFi.removeEvent(_wifiEventListenerId);
-  WiFi.disconnect(true, true);
-  WiFi.mode(WIFI_MODE_NULL);
+  // no new event can reach the queue once the listener is removed and the queue unpublished
+  if (!_isReplaying())
+    WiFi.removeEvent(_wifiEventListenerId);
+  QueueHandle_t events = _events.exchange(nullptr);
+  if (events != nullptr)
+    vQueueDelete(events);
+  if (!_isReplaying()) {
+    tcpip_callback(unhookTraffic, nullptr);
+    WiFi.disconnect(true, true);
+    WiFi.mode(WIFI_MODE_NULL);
+  }
   _stopAP();
-  _httpd = nullptr;
+  _stopProbe();
+  if (_probeClient != nullptr) {
+    delete _probeClient;
+    _probeClient = nullptr;
+  }
+#ifndef ESPCONNECT_NO_MDNS
+  if (_mdnsStarted) {
+    MDNS.end();
+    _mdnsStarted = false;
+  }
+#endif
+  _removePortalHandlers();
 }
 
 void Soylent::ESPConnect::loop() {
+  // in task mode, only the ESPConnect task runs the state machine
+  if (_task != nullptr && xTaskGetCurrentTaskHandle() != _task)
+    return;
+
+  Lock lock(this);
+
+  // WiFi events queued in task mode
+  QueueHandle_t events = _events;
+  if (events != nullptr) {
+    arduino_event_id_t event;
+    while (xQueueReceive(events, &event, 0) == pdTRUE)
+      _onWiFiEvent(event);
+  }
+
   if (_dnsServer != nullptr)
     _dnsServer->processNextRequest();
 
+  // connect and portal timeouts, periodic work while connected
+  _timers.advance(_now(), [this](size_t id) { _onTimer(static_cast<Timer>(id)); });
+
+  _updateDNSCache();
+
+#ifdef ESPCONNECT_TRACE
+  // loop() calls are counted and recorded at most every ESPCONNECT_TRACE_LOOP_PERIOD ms
+  if (++_traceLoops == UINT8_MAX || _now() - _traceLast >= ESPCONNECT_TRACE_LOOP_PERIOD) {
+    _record(Soylent::ESPConnect::TraceType::LOOP, _traceLoops);
+    _traceLoops = 0;
+  }
+#endif
+
+  // configuration posted to the captive portal
+  if (_portalConfigPending.exchange(false)) {
+    portENTER_CRITICAL(&_portalConfigLock);
+    const Soylent::ESPConnect::PortalConfig posted = _portalConfig;
+    portEXIT_CRITICAL(&_portalConfigLock);
+    if (_state == Soylent::ESPConnect::State::PORTAL_STARTED) {
+      Lock configLock(_configMutex);
+      _config.apMode = posted.apMode;
+      if (!posted.apMode) {
+        _config.wifiSSID = posted.ssid;
+        _config.wifiPassword = posted.password;
+      }
+      _publishConfig();
+      _setState(Soylent::ESPConnect::State::PORTAL_COMPLETE);
+    }
+  }
+
+  // captive portal scan, asked for by the scan handler
+  if (_captivePortalEnabled && !_isReplaying()) {
+    if (_scanRequested) {
+      const int n = WiFi.scanComplete();
+      if (n >= 0) {
+        // new results: refresh the cache
+        _cacheScan();
+      } else if (n == WIFI_SCAN_FAILED) {
+        // scan error or results already cached ?
+        // re-scan in the background
+        _scanRequested = false;
+        _scan();
+      }
+    }
+    if (_scanCached && _now() - _scanCachedAt > ESPCONNECT_SCAN_CACHE_MAX_AGE) {
+      // too old to be listed: the portal waits for a new scan
+      LOGD(TAG, "Scan cache expired");
+      portENTER_CRITICAL(&_scanCacheLock);
+      _scanCached = false;
+      _scanCacheCount = 0;
+      portEXIT_CRITICAL(&_scanCacheLock);
+    }
+  }
+
   // first check if we have to enter AP mode
   if (_state == Soylent::ESPConnect::State::NETWORK_ENABLED && _config.apMode) {
     _startAP();
@@ -253,23 +877,22 @@ void Soylent::ESPConnect::loop() {
 
   // start captive portal when network enabled but not in ap mode and no wifi info
   // portal wil be interrupted when network connected
+#ifdef ESPCONNECT_ETH_SUPPORT
+  // Ethernet is started alongside: the portal is closed when it gets an IP (an Ethernet link already up connects right away)
+  if (_state == Soylent::ESPConnect::State::NETWORK_ENABLED && _config.wifiSSID.empty() && !_hasIP(Soylent::ESPConnect::Mode::ETH)) {
+    _startEthernet();
+    _startAP();
+  }
+#else
   if (_state == Soylent::ESPConnect::State::NETWORK_ENABLED && _config.wifiSSID.empty()) {
     _startAP();
   }
+#endif
 
-  // otherwise, tries to connect to WiFi
+  // otherwise, tries to connect to Ethernet (if supported) and WiFi (if configured)
+  // the captive portal is the last resort, started on connect timeout
   if (_state == Soylent::ESPConnect::State::NETWORK_ENABLED) {
-    if (!_config.wifiSSID.empty())
-      _startSTA();
-  }
-
-  // connection to WiFi timed out ?
-  if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING && _durationPassed(_connectTimeout)) {
-    if (WiFi.getMode() != WIFI_MODE_NULL) {
-      WiFi.config(static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000));
-      WiFi.disconnect(true, true);
-    }
-    _setState(Soylent::ESPConnect::State::NETWORK_TIMEOUT);
+    _startSTA();
   }
 
   // start captive portal on connect timeout
@@ -277,10 +900,75 @@ void Soylent::ESPConnect::loop() {
     _startAP();
   }
 
-  // timeout portal if we failed to connect to WiFi (we got a SSID) and portal duration is passed
-  // in order to restart and try again to connect to the configured WiFi
-  if (_state == Soylent::ESPConnect::State::PORTAL_STARTED && !_config.wifiSSID.empty() && _durationPassed(_portalTimeout)) {
-    _setState(Soylent::ESPConnect::State::PORTAL_TIMEOUT);
+  // network ready once the readiness probe succeeded
+  if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && !_networkReady) {
+    if (_readinessProbe == Soylent::ESPConnect::ReadinessProbe::NONE || _probeStatus == Soylent::ESPConnect::ProbeStatus::PASSED) {
+      _stopProbe();
+      _networkReady = true;
+      _readyDelay = _now() - _connectedSince;
+      LOGI(TAG, "Network ready after %" PRIu32 " ms (probe: %" PRIu32 " ms)", _readyDelay, _probeRTT);
+    } else if (!_isScheduled(Soylent::ESPConnect::Timer::READINESS)) {
+      _schedule(Soylent::ESPConnect::Timer::READINESS, 0);
+    }
+  }
+
+  // fast wake: the config skipped at boot is loaded once the retained connection is up or abandoned
+  if (_configDeferred && !(_state == Soylent::ESPConnect::State::NETWORK_CONNECTING && _fastPath)) {
+    _loadDeferredConfig();
+  }
+
+  // the reused lease is a static IP: restart the DHCP client at its renewal time (T1) to get a lease of our own
+  if (_leaseReused && _state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::STA && !_isScheduled(Soylent::ESPConnect::Timer::DHCP_RENEW)) {
+    const time_t now = time(nullptr);
+    const uint32_t remaining = wakeCache.leaseExpiry > now ? std::min<uint32_t>(wakeCache.leaseExpiry - now, 86400) : 0;
+    _schedule(Soylent::ESPConnect::Timer::DHCP_RENEW, remaining * 1000);
+  }
+
+  // first connection with these credentials: derive the PMK once for the next connections (PMK cache in NVS, fast wake in RTC memory).
+  // PBKDF2 runs in a low priority task, outside of the lock: the state machine keeps running meanwhile
+  if ((_pmkCache || _fastWake) && !_pmkDerived && !_pmkDeriving && _state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::STA) {
+    _pmkDerived = true;
+    if (!_config.wifiPassword.empty() && pmkSupported()) {
+      PMKJob* job = new PMKJob{this, _config.wifiSSID, _config.wifiPassword, std::string(), false};
+      _pmkDeriving = true;
+      if (xTaskCreate(_derivePMKTask, "espconnect-pmk", ESPCONNECT_PMK_TASK_STACK_SIZE, job, ESPCONNECT_PMK_TASK_PRIORITY, nullptr) != pdPASS) {
+        LOGE(TAG, "Failed to start the PMK derivation task");
+        _pmkDeriving = false;
+        delete job;
+      }
+    }
+  }
+
+  // derived PMK, dropped if the credentials changed meanwhile
+  PMKJob* job = _isReplaying() ? nullptr : _pmkJob.exchange(nullptr);
+  if (job != nullptr) {
+    if (job->derived && job->ssid == _config.wifiSSID && job->password == _config.wifiPassword) {
+      _pmk = job->pmk;
+      // kept in NVS only when the config itself is (begin() without config)
+      if (_pmkCache && _autoSave) {
+        Preferences preferences;
+        preferences.begin("ESPConnect", false);
+        preferences.putString("pmk", _pmk.c_str());
+        preferences.putUInt("pmk_id", pmkId(_config.wifiSSID, _config.wifiPassword));
+        preferences.end();
+      }
+      // the connection could not be retained without it
+      if (_fastWake && _state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::STA)
+        _saveWakeCache();
+    }
+    delete job;
+    _pmkDeriving = false;
+  }
+
+  // start link sampling, roaming and modem sleep control once connected
+  if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && !_isScheduled(Soylent::ESPConnect::Timer::LINK_SAMPLE)) {
+    _schedule(Soylent::ESPConnect::Timer::LINK_SAMPLE, 0);
+    _schedule(Soylent::ESPConnect::Timer::ROAM, 1000);
+    _schedule(Soylent::ESPConnect::Timer::POWER, 500);
+    _schedule(Soylent::ESPConnect::Timer::TRAFFIC, _trafficSampleInterval);
+    _trafficSampled = _now();
+    if (!_isReplaying())
+      tcpip_callback(hookTraffic, nullptr);
   }
 
   // disconnect from network ? reconnect!
@@ -288,13 +976,48 @@ void Soylent::ESPConnect::loop() {
     _setState(Soylent::ESPConnect::State::NETWORK_RECONNECTING);
   }
 
+#ifdef ESPCONNECT_ETH_SUPPORT
+  // Ethernet got its IP before its event could be handled: started by the application before begin(), or while the portal was starting
+  if (_retryMode == Soylent::ESPConnect::Mode::NONE && _hasIP(Soylent::ESPConnect::Mode::ETH)) {
+    if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING) {
+      _startMDNS();
+      _warmDNSCache();
+      _activeMode = Soylent::ESPConnect::Mode::ETH;
+      _setState(Soylent::ESPConnect::State::NETWORK_CONNECTED);
+    } else if ((_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) && (_backgroundRetry || _config.wifiSSID.empty())) {
+      _retryMode = Soylent::ESPConnect::Mode::ETH;
+    }
+  }
+
+  // the other interface was kept up: fail over to it without waiting for a full reconnect
+  if (_state == Soylent::ESPConnect::State::NETWORK_RECONNECTING && _failoverMode() != Soylent::ESPConnect::Mode::NONE) {
+    _activeMode = _failoverMode();
+    LOGI(TAG, "Failover to %s", _activeMode == Soylent::ESPConnect::Mode::ETH ? "ETH" : "STA");
+    _setState(Soylent::ESPConnect::State::NETWORK_CONNECTED);
+  }
+#endif
+
+  // background retry succeeded: close the portal before announcing the connection
+  if (_retryMode != Soylent::ESPConnect::Mode::NONE) {
+    if (_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) {
+      LOGI(TAG, "Connected while portal running: closing portal");
+      _stopAP();
+      _startMDNS();
+      _warmDNSCache();
+      _activeMode = _retryMode;
+      _setState(Soylent::ESPConnect::State::NETWORK_CONNECTED);
+    }
+    _retryMode = Soylent::ESPConnect::Mode::NONE;
+  }
+
   if (_state == Soylent::ESPConnect::State::AP_STARTED || _state == Soylent::ESPConnect::State::NETWORK_CONNECTED) {
     _disableCaptivePortal();
   }
 
   if (_state == Soylent::ESPConnect::State::PORTAL_COMPLETE || _state == Soylent::ESPConnect::State::PORTAL_TIMEOUT) {
     _stopAP();
-    if (_autoRestart) {
+    // a replay goes on as without auto restart
+    if (_autoRestart && !_isReplaying()) {
       LOGW(TAG, "Auto Restart of ESP...");
       ESP.restart();
     } else {
@@ -304,36 +1027,167 @@ void Soylent::ESPConnect::loop() {
 }
 
 void Soylent::ESPConnect::clearConfiguration() {
+  Lock lock(this);
+  wakeCache.magic = 0;
   Preferences preferences;
   preferences.begin("ESPConnect", false);
   preferences.clear();
   preferences.end();
 }
 
+uint32_t Soylent::ESPConnect::getPowerModeDuration(wifi_ps_type_t mode) const {
+  if (mode > WIFI_PS_MAX_MODEM)
+    return 0;
+  Lock lock(this);
+  return _powerModeDurations[mode] + (mode == _powerMode ? _now() - _powerModeSince : 0);
+}
+
 void Soylent::ESPConnect::toJson(const JsonObject& root) const {
+  Lock lock(this);
+  root["ap_channel"] = _apChannel;
+  root["ap_channel_score"] = _apChannelScore;
   root["ip_address"] = getIPAddress().toString();
   root["ip_address_ap"] = getIPAddress(Soylent::ESPConnect::Mode::AP).toString();
   root["ip_address_sta"] = getIPAddress(Soylent::ESPConnect::Mode::STA).toString();
   root["mac_address"] = getMACAddress();
   root["mac_address_ap"] = getMACAddress(Soylent::ESPConnect::Mode::AP);
   root["mac_address_sta"] = getMACAddress(Soylent::ESPConnect::Mode::STA);
-  root["mode"] = getMode() == Soylent::ESPConnect::Mode::AP ? "AP" : (getMode() == Soylent::ESPConnect::Mode::STA ? "STA" : "NONE");
+#ifdef ESPCONNECT_ETH_SUPPORT
+  root["ip_address_eth"] = getIPAddress(Soylent::ESPConnect::Mode::ETH).toString();
+  root["mac_address_eth"] = getMACAddress(Soylent::ESPConnect::Mode::ETH);
+#endif
+#if ARDUINOJSON_VERSION_MAJOR == 6
+  JsonObject memory = root.createNestedObject("memory");
+#else
+  JsonObject memory = root["memory"].to<JsonObject>();
+#endif
+  for (size_t i = 0; i < sizeof(_memoryStats) / sizeof(_memoryStats[0]); i++) {
+    const Soylent::ESPConnect::MemoryStats stats = getMemoryStats(static_cast<Soylent::ESPConnect::State>(i));
+    if (stats.samples == 0)
+      continue;
+#if ARDUINOJSON_VERSION_MAJOR == 6
+    JsonObject entry = memory.createNestedObject(getStateName(static_cast<Soylent::ESPConnect::State>(i)));
+#else
+    JsonObject entry = memory[getStateName(static_cast<Soylent::ESPConnect::State>(i))].to<JsonObject>();
+#endif
+    entry["samples"] = stats.samples;
+    entry["heap_free_min"] = stats.heapFreeMin;
+    entry["heap_free_max"] = stats.heapFreeMax;
+    entry["heap_lowest"] = stats.heapLowest;
+    entry["psram_free_min"] = stats.psramFreeMin;
+    entry["psram_free_max"] = stats.psramFreeMax;
+    entry["stack_free_events"] = stats.stackFreeEvents;
+    entry["stack_free_httpd"] = stats.stackFreeHttpd;
+    entry["stack_free_loop"] = stats.stackFreeLoop;
+  }
+  const Soylent::ESPConnect::Mode mode = getMode();
+  root["mode"] = ModeName(mode);
+  root["network_probe_rtt"] = _probeRTT;
+  root["network_ready"] = _networkReady;
+  root["network_ready_delay"] = _readyDelay;
+  root["portal_drops_busy"] = _portalBusyDrops;
+  root["portal_peak_allocation"] = getPortalPeakAllocation();
+  root["portal_drops_rate"] = _portalRateDrops;
+  root["power_mode"] = PowerModeNames[_powerMode];
+  root["power_time_none"] = getPowerModeDuration(WIFI_PS_NONE);
+  root["power_time_min_modem"] = getPowerModeDuration(WIFI_PS_MIN_MODEM);
+  root["power_time_max_modem"] = getPowerModeDuration(WIFI_PS_MAX_MODEM);
   root["state"] = getStateName();
+#if ARDUINOJSON_VERSION_MAJOR == 6
+  JsonObject traffic = root.createNestedObject("traffic");
+#else
+  JsonObject traffic = root["traffic"].to<JsonObject>();
+#endif
+#ifdef ESPCONNECT_ETH_SUPPORT
+  trafficToJson(traffic, "eth", _trafficStats[1]);
+#endif
+  trafficToJson(traffic, "sta", _trafficStats[0]);
+  traffic["tcp_retransmit_rate"] = _tcpRetransmitRate;
+  traffic["tcp_retransmits"] = _tcpRetransmits;
   root["wifi_bssid"] = getWiFiBSSID();
+  root["wifi_disconnects_per_hour"] = _linkStats.disconnectRate;
+  root["wifi_roam_count"] = _roamCount;
+  root["wifi_roam_gain"] = _roamGain;
   root["wifi_rssi"] = getWiFiRSSI();
+  root["wifi_rssi_ewma"] = _linkStats.ewma;
+  root["wifi_rssi_max"] = _linkStats.max;
+  root["wifi_rssi_min"] = _linkStats.min;
+  root["wifi_rssi_p10"] = _linkStats.p10;
+  root["wifi_rssi_p50"] = _linkStats.p50;
+  root["wifi_rssi_p90"] = _linkStats.p90;
   root["wifi_signal"] = getWiFiSignalQuality();
+  root["wifi_signal_ewma"] = _linkStats.quality;
   root["wifi_ssid"] = getWiFiSSID();
 }
 
+void Soylent::ESPConnect::_scanToJson(const JsonArray& root, const Soylent::ESPConnect::ScanEntry* entries, uint8_t count) {
+  for (uint8_t i = 0; i < count; ++i) {
+#if ARDUINOJSON_VERSION_MAJOR == 6
+    JsonObject entry = root.createNestedObject();
+#else
+    JsonObject entry = root.add<JsonObject>();
+#endif
+    entry["name"] = entries[i].ssid;
+    entry["rssi"] = entries[i].rssi;
+    entry["signal"] = _wifiSignalQuality(entries[i].rssi);
+    entry["open"] = entries[i].open;
+  }
+}
+
+const char* Soylent::ESPConnect::_parsePortalForm(const char* apMode, const char* ssid, const char* password, Soylent::ESPConnect::PortalConfig& config) {
+  config.apMode = strcmp(apMode, "true") == 0;
+  if (config.apMode) {
+    config.ssid[0] = '\0';
+    config.password[0] = '\0';
+    return nullptr;
+  }
+  const size_t ssidLength = strlen(ssid);
+  const size_t passwordLength = strlen(password);
+  if (ssidLength == 0)
+    return "{\"message\":\"Invalid SSID\"}";
+  if (ssidLength > 32 || passwordLength > 64 || (passwordLength > 0 && passwordLength < 8))
+    return "{\"message\":\"Credentials exceed character limit of 32 & 64 respectively, or password lower than 8 characters.\"}";
+  memcpy(config.ssid, ssid, ssidLength + 1);
+  memcpy(config.password, password, passwordLength + 1);
+  return nullptr;
+}
+
+std::unique_ptr<AsyncWebServerResponse> Soylent::ESPConnect::_beginPortalPage() {
+  std::unique_ptr<AsyncWebServerResponse> response(new AsyncProgmemResponse(200, "text/html", ESPCONNECT_HTML, sizeof(ESPCONNECT_HTML)));
+  response->addHeader("Content-Encoding", "gzip");
+  return response;
+}
+
 void Soylent::ESPConnect::_setState(Soylent::ESPConnect::State state) {
   if (_state == state)
     return;
 
   const Soylent::ESPConnect::State previous = _state;
+  _sampleMemory(previous);
   _state = state;
+  // state changed by another task (i.e. the portal): let the task mode react right away
+  _wake();
+  _networkReady = false;
+  if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+    _connectedSince = _now();
+  // the next connection runs its own probe
+  if (previous == Soylent::ESPConnect::State::NETWORK_CONNECTED) {
+    _probeStatus = Soylent::ESPConnect::ProbeStatus::IDLE;
+    _probeRTT = 0;
+  }
+  _sampleMemory(state);
   LOGD(TAG, "State: %s => %s", getStateName(previous), getStateName(state));
 
+#ifdef ESPCONNECT_TRACE
+  _record(Soylent::ESPConnect::TraceType::STATE, static_cast<uint8_t>(state));
+  if (_replayCallback != nullptr)
+    _replayCallback(_now(), previous, state);
+#endif
+
   // be sure to save anything before auto restart and callback
+  if (_state == Soylent::ESPConnect::State::PORTAL_COMPLETE)
+    wakeCache.magic = 0;
+
   if (_autoSave && _state == Soylent::ESPConnect::State::PORTAL_COMPLETE) {
     LOGD(TAG, "Saving config...");
     LOGD(TAG, " - AP: %d", _config.apMode);
@@ -345,9 +1199,14 @@ void Soylent::ESPConnect::_setState(Soylent::ESPConnect::State state) {
       preferences.putString("ssid", _config.wifiSSID.c_str());
       preferences.putString("password", _config.wifiPassword.c_str());
     }
+    // derived again on the next connection
+    preferences.remove("pmk");
+    preferences.remove("pmk_id");
     preferences.end();
   }
 
+  _updateMDNS();
+
   // make sure callback is called before auto restart
   if (_callback != nullptr)
     _callback(previous, state);
@@ -356,59 +1215,101 @@ void Soylent::ESPConnect::_setState(Soylent::ESPConnect::State state) {
 void Soylent::ESPConnect::_startSTA() {
   _setState(Soylent::ESPConnect::State::NETWORK_CONNECTING);
 
-  LOGI(TAG, "Starting WiFi...");
+#ifdef ESPCONNECT_ETH_SUPPORT
+  _startEthernet();
+#endif
 
-  WiFi.setScanMethod(WIFI_ALL_CHANNEL_SCAN);
-  WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
-  WiFi.setHostname(_hostname.c_str());
-  WiFi.setSleep(false);
-  WiFi.persistent(false);
-  WiFi.setAutoReconnect(true);
-  WiFi.mode(WIFI_STA);
+  // a replay gets the connection from the recorded events
+  if (!_config.wifiSSID.empty() && !_isReplaying()) {
+    LOGI(TAG, "Starting WiFi...");
+
+    // the retained access point is joined directly, without scanning all channels
+    WiFi.setScanMethod(_fastPath ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN);
+    WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
+    WiFi.setHostname(_hostname.c_str());
+    // connect without modem sleep, the power profile applies once connected
+    _setPowerMode(WIFI_PS_NONE);
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(true);
+    WiFi.mode(WIFI_STA);
+
+    if (_ipConfig.ip) {
+      LOGI(TAG, "Set WiFi Static IP Configuration:");
+      LOGI(TAG, " - IP: %s", _ipConfig.ip.toString().c_str());
+      LOGI(TAG, " - Gateway: %s", _ipConfig.gateway.toString().c_str());
+      LOGI(TAG, " - Subnet: %s", _ipConfig.subnet.toString().c_str());
+      LOGI(TAG, " - DNS: %s", _ipConfig.dns.toString().c_str());
+
+      WiFi.config(_ipConfig.ip, _ipConfig.gateway, _ipConfig.subnet, _ipConfig.dns);
+    } else if (_fastPath && wakeCache.leaseExpiry > time(nullptr)) {
+      LOGI(TAG, "Reusing DHCP lease: %s", IPAddress(wakeCache.ip).toString().c_str());
+      WiFi.config(wakeCache.ip, wakeCache.gateway, wakeCache.subnet, wakeCache.dns);
+      _leaseReused = true;
+    }
 
-  if (_ipConfig.ip) {
-    LOGI(TAG, "Set WiFi Static IP Configuration:");
-    LOGI(TAG, " - IP: %s", _ipConfig.ip.toString().c_str());
-    LOGI(TAG, " - Gateway: %s", _ipConfig.gateway.toString().c_str());
-    LOGI(TAG, " - Subnet: %s", _ipConfig.subnet.toString().c_str());
-    LOGI(TAG, " - DNS: %s", _ipConfig.dns.toString().c_str());
+    if (_fastPath) {
+      LOGD(TAG, "Connecting to SSID: %s on channel %d...", _config.wifiSSID.c_str(), wakeCache.channel);
+      WiFi.begin(_config.wifiSSID.c_str(), _psk(), wakeCache.channel, wakeCache.bssid);
+      _schedule(Soylent::ESPConnect::Timer::FAST_WAKE, ESPCONNECT_FAST_WAKE_TIMEOUT);
+    } else {
+      LOGD(TAG, "Connecting to SSID: %s...", _config.wifiSSID.c_str());
+      WiFi.begin(_config.wifiSSID.c_str(), _psk());
+      // scan before the attempt times out, early enough for the whole scan to finish, so that the captive portal lists networks right away
+      const uint32_t lead = scanDuration() + ESPCONNECT_SCAN_PREFETCH_MARGIN;
+      if (_connectTimeout * 1000 > lead)
+        _schedule(Soylent::ESPConnect::Timer::SCAN_PREFETCH, _connectTimeout * 1000 - lead);
+    }
 
-    WiFi.config(_ipConfig.ip, _ipConfig.gateway, _ipConfig.subnet, _ipConfig.dns);
+    LOGD(TAG, "WiFi started.");
   }
 
-  LOGD(TAG, "Connecting to SSID: %s...", _config.wifiSSID.c_str());
-  WiFi.begin(_config.wifiSSID.c_str(), _config.wifiPassword.c_str());
-
-  _lastTime = millis();
-
-  LOGD(TAG, "WiFi started.");
+  _schedule(Soylent::ESPConnect::Timer::CONNECT_TIMEOUT, _connectTimeout * 1000);
 }
 
 void Soylent::ESPConnect::_startAP() {
   _setState(_config.apMode ? Soylent::ESPConnect::State::AP_STARTING : Soylent::ESPConnect::State::PORTAL_STARTING);
 
+  // a replay gets the soft AP start from the recorded ARDUINO_EVENT_WIFI_AP_START
+  if (_isReplaying()) {
+    if (!_config.apMode)
+      _enableCaptivePortal();
+    return;
+  }
+
   LOGI(TAG, "Starting Access Point...");
 
   WiFi.softAPsetHostname(_hostname.c_str());
   WiFi.setScanMethod(WIFI_ALL_CHANNEL_SCAN);
   WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
   WiFi.setHostname(_hostname.c_str());
-  WiFi.setSleep(false);
+  // modem sleep is not supported by the soft AP
+  _setPowerMode(WIFI_PS_NONE);
   WiFi.persistent(false);
   WiFi.setAutoReconnect(false);
   WiFi.softAPConfig(IPAddress(192, 168, 4, 1), IPAddress(192, 168, 4, 1), IPAddress(255, 255, 255, 0));
 
   WiFi.mode(_config.apMode ? WIFI_AP : WIFI_AP_STA);
 
-  if (_apPassword.empty() || _apPassword.length() < 8) {
-    // Disabling invalid Access Point password which must be at least 8 characters long when set
-    WiFi.softAP(_apSSID.c_str(), "");
-  } else {
-    WiFi.softAP(_apSSID.c_str(), _apPassword.c_str());
+  // finished scan (prefetch while connecting): listed by the portal, and used to select the channel
+  _cacheScan();
+
+  if (_apChannelSelection) {
+    if (_channelsScored) {
+      _apChannel = _bestChannel();
+      _apChannelScore = _channelScores[_apChannel - 1];
+    }
   }
+  _softAP();
+
+  if (_apChannelSelection && _apChannelReevaluation)
+    _schedule(Soylent::ESPConnect::Timer::AP_CHANNEL, ESPCONNECT_AP_CHANNEL_INTERVAL * 1000);
 
   if (_dnsServer == nullptr) {
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+    _dnsServer = new (_dnsServerStorage) DNSServer();
+#else
     _dnsServer = new DNSServer();
+#endif
     _dnsServer->setErrorReplyCode(DNSReplyCode::NoError);
     _dnsServer->start(53, "*", WiFi.softAPIP());
   }
@@ -422,11 +1323,17 @@ void Soylent::ESPConnect::_startAP() {
 void Soylent::ESPConnect::_stopAP() {
   _disableCaptivePortal();
   LOGI(TAG, "Stopping Access Point...");
-  _lastTime = -1;
-  WiFi.softAPdisconnect(true);
+  _cancel(Soylent::ESPConnect::Timer::PORTAL_TIMEOUT);
+  _cancel(Soylent::ESPConnect::Timer::AP_CHANNEL);
+  if (!_isReplaying())
+    WiFi.softAPdisconnect(true);
   if (_dnsServer != nullptr) {
     _dnsServer->stop();
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+    _dnsServer->~DNSServer();
+#else
     delete _dnsServer;
+#endif
     _dnsServer = nullptr;
   }
   LOGD(TAG, "Access Point stopped.");
@@ -434,111 +1341,264 @@ void Soylent::ESPConnect::_stopAP() {
 
 void Soylent::ESPConnect::_enableCaptivePortal() {
   LOGI(TAG, "Enable Captive Portal...");
-  _scan();
+  _captivePortalEnabled = true;
+  memset(_portalClients, 0, sizeof(_portalClients));
+  _schedule(Soylent::ESPConnect::Timer::PORTAL_TIMEOUT, _portalTimeout * 1000);
 
-  if (_scanHandler == nullptr) {
-    _scanHandler = &_httpd->on("/espconnect/scan", HTTP_GET, [&](AsyncWebServerRequest* request) {
-      int n = WiFi.scanComplete();
+  if (_isRetrying()) {
+    _retryBackoff = ESPCONNECT_RETRY_BACKOFF_MIN;
+    _schedule(Soylent::ESPConnect::Timer::STA_RETRY, _retryBackoff * 1000);
+  }
 
-      if (n == WIFI_SCAN_RUNNING) {
-        // scan still running ? wait...
-        request->send(202);
+  // no web server: stubbed out by a replay, or released by end()
+  if (_isReplaying() || _httpd == nullptr)
+    return;
 
-      } else if (n == WIFI_SCAN_FAILED) {
-        // scan error or finished with no result ?
-        // re-scan
-        _scan();
+  // a prefetch scan still running is kept: loop() caches it for the first poll
+  if (WiFi.scanComplete() == WIFI_SCAN_FAILED)
+    _scan();
+
+  if (_scanHandler == nullptr) {
+    _scanHandler = &_httpd->on("/espconnect/scan", HTTP_GET, [&](AsyncWebServerRequest* request) {
+      if (!_admitPortalRequest(request))
+        return;
+      HandlerProbe probe(this);
+      // loop() caches the finished scan or starts a new one: the cache is refreshed for the next request
+      _scanRequested = true;
+      _wake();
+
+      Soylent::ESPConnect::ScanEntry entries[ESPCONNECT_SCAN_CACHE_SIZE];
+      uint32_t cachedAt;
+      const int count = _copyScanCache(entries, cachedAt);
+
+      if (count < 0) {
+        // first scan still running ? wait...
         request->send(202);
 
       } else {
-        // scan results ?
-        AsyncJsonResponse* response = new AsyncJsonResponse(true);
-        JsonArray json = response->getRoot();
-
-        // we have some results
-        for (int i = 0; i < n; ++i) {
-#if ARDUINOJSON_VERSION_MAJOR == 6
-          JsonObject entry = json.createNestedObject();
-#else
-            JsonObject entry = json.add<JsonObject>();
+        // cached results, possibly from the scan made while connecting
+        AsyncWebServerResponse* response = nullptr;
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+        if (!_scanResponseBusy) {
+          _scanResponseBusy = true;
+          // replaces the callback set by _admitPortalRequest()
+          request->onDisconnect([this]() {
+            _portalInflight--;
+            _scanResponseBusy = false;
+          });
+          response = request->beginResponse(200, "application/json", reinterpret_cast<const uint8_t*>(_scanResponse), _writeScanResponse(entries, count));
+        }
 #endif
-          entry["name"] = WiFi.SSID(i);
-          entry["rssi"] = WiFi.RSSI(i);
-          entry["signal"] = _wifiSignalQuality(WiFi.RSSI(i));
-          entry["open"] = WiFi.encryptionType(i) == WIFI_AUTH_OPEN;
+        if (response == nullptr) {
+          AsyncJsonResponse* jsonResponse = new AsyncJsonResponse(true);
+          JsonArray json = jsonResponse->getRoot();
+          _scanToJson(json, entries, count);
+          jsonResponse->setLength();
+          response = jsonResponse;
         }
-
-        WiFi.scanDelete();
-        response->setLength();
+        // seconds since the access points were scanned
+        char age[11];
+        snprintf(age, sizeof(age), "%" PRIu32, (_now() - cachedAt) / 1000);
+        response->addHeader("X-Scan-Age", age);
         request->send(response);
       }
     });
+    _scanHandler->setFilter([&](__unused AsyncWebServerRequest* request) {
+      return _state == Soylent::ESPConnect::State::PORTAL_STARTED;
+    });
   }
 
   if (_connectHandler == nullptr) {
     _connectHandler = &_httpd->on("/espconnect/connect", HTTP_POST, [&](AsyncWebServerRequest* request) {
-      _config.apMode = request->hasParam("ap_mode", true) && request->getParam("ap_mode", true)->value() == "true";
-      if (_config.apMode) {
-        request->send(200, "application/json", "{\"message\":\"Configuration Saved.\"}");
-        _setState(Soylent::ESPConnect::State::PORTAL_COMPLETE);
-      } else {
-        std::string ssid;
-        std::string password;
-        if (request->hasParam("ssid", true))
-          ssid = request->getParam("ssid", true)->value().c_str();
-        if (request->hasParam("password", true))
-          password = request->getParam("password", true)->value().c_str();
-        if (ssid.empty())
-          return request->send(400, "application/json", "{\"message\":\"Invalid SSID\"}");
-        if (ssid.length() > 32 || password.length() > 64 || (!password.empty() && password.length() < 8))
-          return request->send(400, "application/json", "{\"message\":\"Credentials exceed character limit of 32 & 64 respectively, or password lower than 8 characters.\"}");
-        _config.wifiSSID = ssid;
-        _config.wifiPassword = password;
-        request->send(200, "application/json", "{\"message\":\"Configuration Saved.\"}");
-        _setState(Soylent::ESPConnect::State::PORTAL_COMPLETE);
-      }
+      if (!_admitPortalRequest(request))
+        return;
+      HandlerProbe probe(this);
+      // read in place from the request parameters
+      const char* apMode = request->hasParam("ap_mode", true) ? request->getParam("ap_mode", true)->value().c_str() : "";
+      const char* ssid = request->hasParam("ssid", true) ? request->getParam("ssid", true)->value().c_str() : "";
+      const char* password = request->hasParam("password", true) ? request->getParam("password", true)->value().c_str() : "";
+      Soylent::ESPConnect::PortalConfig config;
+      const char* error = _parsePortalForm(apMode, ssid, password, config);
+      if (error != nullptr)
+        return request->send(400, "application/json", error);
+      portENTER_CRITICAL(&_portalConfigLock);
+      _portalConfig = config;
+      portEXIT_CRITICAL(&_portalConfigLock);
+      _portalConfigPending = true;
+      _wake();
+      request->send(200, "application/json", "{\"message\":\"Configuration Saved.\"}");
+    });
+    _connectHandler->setFilter([&](__unused AsyncWebServerRequest* request) {
+      return _state == Soylent::ESPConnect::State::PORTAL_STARTED;
     });
   }
 
   if (_homeHandler == nullptr) {
-    _homeHandler = &_httpd->on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
-      AsyncWebServerResponse* response = request->beginResponse(200, "text/html", ESPCONNECT_HTML, sizeof(ESPCONNECT_HTML));
-      response->addHeader("Content-Encoding", "gzip");
-      return request->send(response);
+    _homeHandler = &_httpd->on("/", HTTP_GET, [&](AsyncWebServerRequest* request) {
+      if (!_admitPortalRequest(request))
+        return;
+      HandlerProbe probe(this);
+      return request->send(_beginPortalPage().release());
     });
     _homeHandler->setFilter([&](__unused AsyncWebServerRequest* request) {
       return _state == Soylent::ESPConnect::State::PORTAL_STARTED;
     });
   }
 
-  _httpd->onNotFound([](AsyncWebServerRequest* request) {
-    AsyncWebServerResponse* response = request->beginResponse(200, "text/html", ESPCONNECT_HTML, sizeof(ESPCONNECT_HTML));
-    response->addHeader("Content-Encoding", "gzip");
-    return request->send(response);
+  _httpd->onNotFound([&](AsyncWebServerRequest* request) {
+    if (!_admitPortalRequest(request))
+      return;
+    HandlerProbe probe(this);
+    return request->send(_beginPortalPage().release());
   });
 
   _httpd->begin();
 #ifndef ESPCONNECT_NO_MDNS
-  MDNS.addService("http", "tcp", 80);
+  // an application-registered http service is left as is
+  if (_findMDNSService("http", "tcp") == nullptr)
+    MDNS.addService("http", "tcp", 80);
 #endif
-  _lastTime = millis();
+}
+
+// Several phones on the soft AP send bursts of connectivity probes and poll the scan results:
+// cap the responses in flight (each one holds heap until sent) and the request rate of each client.
+// Returns false if the request was rejected.
+bool Soylent::ESPConnect::_admitPortalRequest(AsyncWebServerRequest* request) {
+  if (!_takePortalToken(request->client()->remoteIP())) {
+    _portalRateDrops++;
+    rejectPortalRequest(request, PortalRateResponse, sizeof(PortalRateResponse) - 1);
+    return false;
+  }
+  if (_portalInflight >= _portalMaxInflight) {
+    _portalBusyDrops++;
+    rejectPortalRequest(request, PortalBusyResponse, sizeof(PortalBusyResponse) - 1);
+    return false;
+  }
+  _portalInflight++;
+  request->onDisconnect([this]() { _portalInflight--; });
+  return true;
+}
+
+bool Soylent::ESPConnect::_takePortalToken(uint32_t ip) {
+  const uint32_t now = _now();
+  const uint32_t capacity = _portalBurst * 1000UL;
+  Soylent::ESPConnect::PortalClient* entry = nullptr;
+  Soylent::ESPConnect::PortalClient* oldest = &_portalClients[0];
+  for (auto& client : _portalClients) {
+    if (client.ip == ip) {
+      entry = &client;
+      break;
+    }
+    if (static_cast<int32_t>(client.lastMs - oldest->lastMs) < 0)
+      oldest = &client;
+  }
+
+  if (entry == nullptr) {
+    entry = oldest;
+    entry->ip = ip;
+    entry->tokens = capacity;
+  } else {
+    const uint64_t refill = static_cast<uint64_t>(now - entry->lastMs) * _portalRate;
+    entry->tokens = static_cast<uint32_t>(std::min<uint64_t>(capacity, entry->tokens + refill));
+  }
+  entry->lastMs = now;
+
+  if (entry->tokens < 1000)
+    return false;
+  entry->tokens -= 1000;
+  return true;
+}
+
+Soylent::ESPConnect::MemoryStats Soylent::ESPConnect::getMemoryStats(Soylent::ESPConnect::State state) const {
+  portENTER_CRITICAL(&_memoryLock);
+  const Soylent::ESPConnect::MemoryStats stats = _memoryStats[static_cast<size_t>(state)];
+  portEXIT_CRITICAL(&_memoryLock);
+  return stats;
+}
+
+uint32_t Soylent::ESPConnect::getPortalPeakAllocation() const {
+  portENTER_CRITICAL(&_memoryLock);
+  const uint32_t peak = _portalPeakAllocation;
+  portEXIT_CRITICAL(&_memoryLock);
+  return peak;
+}
+
+// the stack high-water mark is kept per sampling task: the figure of one task says nothing about the others
+void Soylent::ESPConnect::_sampleMemory(Soylent::ESPConnect::State state, bool portalHandler) {
+  if (_isReplaying())
+    return;
+
+  // measured outside of the critical section, only the update is locked
+  const uint32_t heapFree = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  const uint32_t psramFree = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  // StackType_t is a byte on ESP32
+  const uint32_t stackFree = uxTaskGetStackHighWaterMark(nullptr);
+  const uint32_t heapLowest = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  const bool eventTask = !portalHandler && xTaskGetCurrentTaskHandle() == _eventTask;
+  portENTER_CRITICAL(&_memoryLock);
+  Soylent::ESPConnect::MemoryStats& stats = _memoryStats[static_cast<size_t>(state)];
+  if (stats.samples == 0) {
+    stats.heapFreeMin = stats.heapFreeMax = heapFree;
+    stats.psramFreeMin = stats.psramFreeMax = psramFree;
+  } else {
+    stats.heapFreeMin = std::min(stats.heapFreeMin, heapFree);
+    stats.heapFreeMax = std::max(stats.heapFreeMax, heapFree);
+    stats.psramFreeMin = std::min(stats.psramFreeMin, psramFree);
+    stats.psramFreeMax = std::max(stats.psramFreeMax, psramFree);
+  }
+  uint32_t& stackFreeMin = portalHandler ? stats.stackFreeHttpd : (eventTask ? stats.stackFreeEvents : stats.stackFreeLoop);
+  stackFreeMin = stackFreeMin == 0 ? stackFree : std::min(stackFreeMin, stackFree);
+  stats.heapLowest = heapLowest;
+  stats.samples++;
+  portEXIT_CRITICAL(&_memoryLock);
+}
+
+// the response built by a handler is still held when it returns: the heap delta measures its allocation
+Soylent::ESPConnect::HandlerProbe::HandlerProbe(Soylent::ESPConnect* espConnect) : espConnect(espConnect), heapBefore(heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)) {
+  espConnect->_sampleMemory(espConnect->_state, true);
+}
+
+Soylent::ESPConnect::HandlerProbe::~HandlerProbe() {
+  const uint32_t heapAfter = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (espConnect->_state == Soylent::ESPConnect::State::PORTAL_STARTED && heapBefore > heapAfter) {
+    portENTER_CRITICAL(&espConnect->_memoryLock);
+    espConnect->_portalPeakAllocation = std::max(espConnect->_portalPeakAllocation, heapBefore - heapAfter);
+    portEXIT_CRITICAL(&espConnect->_memoryLock);
+  }
+  espConnect->_sampleMemory(espConnect->_state, true);
 }
 
 void Soylent::ESPConnect::_disableCaptivePortal() {
-  if (_homeHandler == nullptr)
+  if (!_captivePortalEnabled)
     return;
 
   LOGI(TAG, "Disable Captive Portal...");
+  _captivePortalEnabled = false;
+
+  if (_isReplaying() || _httpd == nullptr)
+    return;
 
   WiFi.scanDelete();
 
 #ifndef ESPCONNECT_NO_MDNS
-  mdns_service_remove("_http", "_tcp");
+  if (_findMDNSService("http", "tcp") == nullptr)
+    mdns_service_remove("_http", "_tcp");
 #endif
 
   _httpd->end();
   _httpd->onNotFound(nullptr);
 
+#ifndef ESPCONNECT_STATIC_PORTAL_OBJECTS
+  _removePortalHandlers();
+#endif
+}
+
+// With ESPCONNECT_STATIC_PORTAL_OBJECTS, the handlers are kept from one portal to the next (their filters only accept requests while the portal runs)
+// and only removed by end()
+void Soylent::ESPConnect::_removePortalHandlers() {
+  if (_httpd == nullptr)
+    return;
+
   if (_connectHandler != nullptr) {
     _httpd->removeHandler(_connectHandler);
     _connectHandler = nullptr;
@@ -559,14 +1619,56 @@ void Soylent::ESPConnect::_onWiFiEvent(WiFiEvent_t event) {
   if (_state == Soylent::ESPConnect::State::NETWORK_DISABLED)
     return;
 
+#ifdef ESPCONNECT_TRACE
+  _record(Soylent::ESPConnect::TraceType::EVENT, static_cast<uint8_t>(event));
+  // the replayed interfaces have an IP from their recorded GOT_IP event to their LOST_IP or disconnection event
+  if (_replaying) {
+    switch (event) {
+      case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        _replayIPs |= 1 << static_cast<uint8_t>(Soylent::ESPConnect::Mode::STA);
+        break;
+      case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        _replayIPs &= ~(1 << static_cast<uint8_t>(Soylent::ESPConnect::Mode::STA));
+        break;
+  #ifdef ESPCONNECT_ETH_SUPPORT
+      case ARDUINO_EVENT_ETH_GOT_IP:
+        _replayIPs |= 1 << static_cast<uint8_t>(Soylent::ESPConnect::Mode::ETH);
+        break;
+    #if ESP_ARDUINO_VERSION_MAJOR >= 3
+      case ARDUINO_EVENT_ETH_LOST_IP:
+    #endif
+      case ARDUINO_EVENT_ETH_DISCONNECTED:
+        _replayIPs &= ~(1 << static_cast<uint8_t>(Soylent::ESPConnect::Mode::ETH));
+        break;
+  #endif
+      default:
+        break;
+    }
+  }
+#endif
+
   switch (event) {
     case ARDUINO_EVENT_WIFI_STA_GOT_IP:
-      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING || _state == Soylent::ESPConnect::State::NETWORK_RECONNECTING) {
+      if ((_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) && _isRetrying()) {
         LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_WIFI_STA_GOT_IP", getStateName());
-        _lastTime = -1;
-#ifndef ESPCONNECT_NO_MDNS
-        MDNS.begin(_hostname.c_str());
-#endif
+        _retryMode = Soylent::ESPConnect::Mode::STA;
+      } else if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _fastWake) {
+        // lease renewed by DHCP after a reused one
+        _saveWakeCache();
+      } else if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING || _state == Soylent::ESPConnect::State::NETWORK_DISCONNECTED || _state == Soylent::ESPConnect::State::NETWORK_RECONNECTING) {
+        LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_WIFI_STA_GOT_IP", getStateName());
+        if (_roamPendingGain != 0) {
+          _roamCount++;
+          _roamGain += _roamPendingGain;
+          _roamPendingGain = 0;
+          LOGI(TAG, "Roamed to BSSID: %s (%d dBm)", WiFi.BSSIDstr().c_str(), WiFi.RSSI());
+        }
+        _startMDNS();
+        _warmDNSCache();
+        if (_fastWake)
+          _saveWakeCache();
+        _activeMode = Soylent::ESPConnect::Mode::STA;
         _setState(Soylent::ESPConnect::State::NETWORK_CONNECTED);
       }
       break;
@@ -575,19 +1677,69 @@ void Soylent::ESPConnect::_onWiFiEvent(WiFiEvent_t event) {
     case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
       if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
         LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_WIFI_STA_DISCONNECTED", getStateName());
-        WiFi.reconnect();
+        if (_roamSkipReconnect) {
+          // leaving the previous access point: association to the new one is already in progress
+          _roamSkipReconnect = false;
+        } else if (_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) {
+          // while the portal runs, connection attempts are driven by the background retry backoff
+        } else if (_roamPinned) {
+          // do not stick to a BSSID that went away: let the driver pick the best access point again
+          _roamPinned = false;
+          _roamPendingGain = 0;
+          if (!_isReplaying())
+            WiFi.begin(_config.wifiSSID.c_str(), _psk());
+        } else if (!_isReplaying()) {
+          WiFi.reconnect();
+        }
       } else {
         LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_WIFI_STA_LOST_IP", getStateName());
       }
-      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED) {
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::STA) {
+        _recordDisconnect();
+      }
+      // losing WiFi while connected through Ethernet is not a network disconnection
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode != Soylent::ESPConnect::Mode::ETH) {
         _setState(Soylent::ESPConnect::State::NETWORK_DISCONNECTED);
       }
       break;
 
-    case ARDUINO_EVENT_WIFI_AP_START:
-#ifndef ESPCONNECT_NO_MDNS
-      MDNS.begin(_hostname.c_str());
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case ARDUINO_EVENT_ETH_START:
+      LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_ETH_START", getStateName());
+      if (!_isReplaying())
+        ETH.setHostname(_hostname.c_str());
+      break;
+
+    case ARDUINO_EVENT_ETH_GOT_IP:
+      LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_ETH_GOT_IP", getStateName());
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING || _state == Soylent::ESPConnect::State::NETWORK_RECONNECTING) {
+        _startMDNS();
+        _warmDNSCache();
+        _activeMode = Soylent::ESPConnect::Mode::ETH;
+        _setState(Soylent::ESPConnect::State::NETWORK_CONNECTED);
+      } else if ((_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) && (_backgroundRetry || _config.wifiSSID.empty())) {
+        _retryMode = Soylent::ESPConnect::Mode::ETH;
+      } else if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode != Soylent::ESPConnect::Mode::ETH) {
+        // Ethernet has priority: switch back to it, WiFi stays connected as a warm standby
+        LOGI(TAG, "Switching back to ETH");
+        _switchActiveMode(Soylent::ESPConnect::Mode::ETH);
+      }
+      break;
+
+    // ARDUINO_EVENT_ETH_LOST_IP only exists since Arduino 3: Arduino 2 reports the loss of the link only
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+    case ARDUINO_EVENT_ETH_LOST_IP:
+#endif
+    case ARDUINO_EVENT_ETH_DISCONNECTED:
+      LOGD(TAG, "[%s] WiFiEvent: %s", getStateName(), event == ARDUINO_EVENT_ETH_DISCONNECTED ? "ARDUINO_EVENT_ETH_DISCONNECTED" : "ARDUINO_EVENT_ETH_LOST_IP");
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::ETH) {
+        _setState(Soylent::ESPConnect::State::NETWORK_DISCONNECTED);
+      }
+      break;
 #endif
+
+    case ARDUINO_EVENT_WIFI_AP_START:
+      _startMDNS();
       if (_state == Soylent::ESPConnect::State::AP_STARTING) {
         LOGD(TAG, "[%s] WiFiEvent: ARDUINO_EVENT_WIFI_AP_START", getStateName());
         _setState(Soylent::ESPConnect::State::AP_STARTED);
@@ -602,15 +1754,1186 @@ void Soylent::ESPConnect::_onWiFiEvent(WiFiEvent_t event) {
   }
 }
 
-bool Soylent::ESPConnect::_durationPassed(uint32_t intervalSec) {
-  if (_lastTime >= 0 && millis() - static_cast<uint32_t>(_lastTime) >= intervalSec * 1000) {
-    _lastTime = -1;
+// timers are only scheduled and expired from loop(): WiFi events never touch them,
+// a timeout firing after the state has moved on is ignored
+void Soylent::ESPConnect::_onTimer(Soylent::ESPConnect::Timer timer) {
+  const bool staActive = _state == Soylent::ESPConnect::State::NETWORK_CONNECTED && _activeMode == Soylent::ESPConnect::Mode::STA;
+
+  switch (timer) {
+    case Soylent::ESPConnect::Timer::CONNECT_TIMEOUT:
+      // connection to WiFi timed out ?
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING) {
+        wakeCache.magic = 0;
+        _fastPath = false;
+        _leaseReused = false;
+        // the stored PMK might not match the network anymore (i.e. moved to WPA3): use the passphrase for the next attempts,
+        // and drop it from NVS so that the next boot does not time out again. Derived again after the next connection if usable.
+        if (!_pmk.empty()) {
+          if (_pmkCache && _autoSave)
+            removePMK();
+          _pmk.clear();
+          _pmkDerived = false;
+        }
+        // the prefetch scan is lost when WiFi is stopped
+        _cacheScan();
+        if (_isReplaying()) {
+          // no attempt to stop
+        } else if (_isRetrying()) {
+          // stop the current attempt but keep the STA configuration for the background retry
+          WiFi.disconnect(false, false);
+        } else if (WiFi.getMode() != WIFI_MODE_NULL) {
+          WiFi.config(static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000));
+          WiFi.disconnect(true, true);
+        }
+        _setState(Soylent::ESPConnect::State::NETWORK_TIMEOUT);
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::DHCP_RENEW:
+      if (_leaseReused && staActive) {
+        LOGI(TAG, "Reused DHCP lease due for renewal: restarting DHCP");
+        _leaseReused = false;
+        _fastPath = false;
+        // the new lease is retained by the next ARDUINO_EVENT_WIFI_STA_GOT_IP
+        WiFi.config(static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000));
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::FAST_WAKE:
+      // retained access point or lease not usable anymore ? full connection
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTING && _fastPath) {
+        LOGW(TAG, "Fast wake connection failed: falling back to full connection");
+        wakeCache.magic = 0;
+        _fastPath = false;
+        _leaseReused = false;
+        if (_configDeferred)
+          _loadDeferredConfig();
+        WiFi.disconnect();
+        if (!_ipConfig.ip)
+          WiFi.config(static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000), static_cast<uint32_t>(0x00000000));
+        _startSTA();
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::STA_RETRY:
+      if (_state == Soylent::ESPConnect::State::PORTAL_STARTING || _state == Soylent::ESPConnect::State::PORTAL_STARTED) {
+        LOGD(TAG, "Background retry: connecting to SSID: %s...", _config.wifiSSID.c_str());
+        if (!_isReplaying())
+          WiFi.begin(_config.wifiSSID.c_str(), _psk());
+        _retryBackoff = std::min<uint32_t>(_retryBackoff * 2, ESPCONNECT_RETRY_BACKOFF_MAX);
+        _schedule(Soylent::ESPConnect::Timer::STA_RETRY, _retryBackoff * 1000);
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::PORTAL_TIMEOUT:
+      // timeout portal if we failed to connect to WiFi (we got a SSID) and portal duration is passed
+      // in order to restart and try again to connect to the configured WiFi
+      if (_state == Soylent::ESPConnect::State::PORTAL_STARTED && !_config.wifiSSID.empty()) {
+        _setState(Soylent::ESPConnect::State::PORTAL_TIMEOUT);
+      } else if (_state == Soylent::ESPConnect::State::PORTAL_STARTING) {
+        // AP not started yet: time out as soon as it is
+        _schedule(Soylent::ESPConnect::Timer::PORTAL_TIMEOUT, 0);
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::AP_CHANNEL:
+      // move the soft AP to a less congested channel, only while nobody is connected to it.
+      // Not while the background retry uses the STA interface to connect.
+      if (!_isReplaying() && (_state == Soylent::ESPConnect::State::AP_STARTED || (_state == Soylent::ESPConnect::State::PORTAL_STARTED && !_isRetrying()))) {
+        const int n = WiFi.scanComplete();
+        if (n == WIFI_SCAN_RUNNING) {
+          _schedule(Soylent::ESPConnect::Timer::AP_CHANNEL, 1000);
+          break;
+        }
+        if (WiFi.softAPgetStationNum() == 0) {
+          if (n == WIFI_SCAN_FAILED) {
+            // no results: scan and come back for them
+            _apScanEnabledSTA = WiFi.getMode() == WIFI_MODE_AP;
+            _scan();
+            _schedule(Soylent::ESPConnect::Timer::AP_CHANNEL, 1000);
+            break;
+          }
+          _cacheScan();
+          const uint8_t best = _bestChannel();
+          // only worth dropping the AP for a clearly better channel
+          if (best != _apChannel && _channelScores[best - 1] * 4 < _channelScores[_apChannel - 1] * 3) {
+            LOGI(TAG, "Moving Access Point to channel %u", best);
+            _apChannel = best;
+            _apChannelScore = _channelScores[best - 1];
+            _softAP();
+          } else {
+            _apChannelScore = _channelScores[_apChannel - 1];
+          }
+        }
+        // scanning switched the soft AP to WIFI_AP_STA: back to WIFI_AP, the next evaluation scans again
+        if (_apScanEnabledSTA) {
+          _apScanEnabledSTA = false;
+          WiFi.scanDelete();
+          WiFi.enableSTA(false);
+        }
+        _schedule(Soylent::ESPConnect::Timer::AP_CHANNEL, ESPCONNECT_AP_CHANNEL_INTERVAL * 1000);
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::READINESS:
+      // start a probe, or a new one if the previous one timed out
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED && !_networkReady) {
+        _startProbe();
+        _schedule(Soylent::ESPConnect::Timer::READINESS, ESPCONNECT_READINESS_TIMEOUT);
+      } else {
+        _stopProbe();
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::LINK_SAMPLE:
+      if (staActive)
+        _sampleLink();
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+        _schedule(Soylent::ESPConnect::Timer::LINK_SAMPLE, _linkSampleInterval);
+      break;
+
+    case Soylent::ESPConnect::Timer::ROAM:
+      // look for a stronger access point of the same SSID
+      if (staActive && _roaming)
+        _roam();
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+        _schedule(Soylent::ESPConnect::Timer::ROAM, 1000);
+      break;
+
+    case Soylent::ESPConnect::Timer::POWER:
+      // adapt modem sleep to traffic and latency budget
+      if (staActive)
+        _adaptPower();
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+        _schedule(Soylent::ESPConnect::Timer::POWER, 500);
+      break;
+
+    case Soylent::ESPConnect::Timer::SCAN_PREFETCH:
+      // a roaming scan only looks for the connected SSID: not for the portal
+      if (!_roamScanning) {
+        const int n = WiFi.scanComplete();
+        if (n >= 0) {
+          // cached whatever the state: the attempt may have timed out and started the portal meanwhile
+          _cacheScan();
+        } else if (n == WIFI_SCAN_RUNNING || _state == Soylent::ESPConnect::State::NETWORK_CONNECTING) {
+          // the driver refuses to scan while associating: try again until the scan starts, then wait for it
+          if (n == WIFI_SCAN_FAILED)
+            _scan();
+          _schedule(Soylent::ESPConnect::Timer::SCAN_PREFETCH, 500);
+        }
+      }
+      break;
+
+    case Soylent::ESPConnect::Timer::TRAFFIC:
+      _sampleTraffic();
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+        _schedule(Soylent::ESPConnect::Timer::TRAFFIC, _trafficSampleInterval);
+      break;
+
+    default:
+      break;
+  }
+}
+
+bool Soylent::ESPConnect::_hasIP(Soylent::ESPConnect::Mode mode) const {
+#ifdef ESPCONNECT_TRACE
+  if (_replaying)
+    return _replayIPs & (1 << static_cast<uint8_t>(mode));
+#endif
+  switch (mode) {
+    case Soylent::ESPConnect::Mode::STA:
+      return WiFi.localIP()[0] != 0;
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case Soylent::ESPConnect::Mode::ETH:
+      return ETH.linkUp() && ETH.localIP()[0] != 0;
+#endif
+    default:
+      return false;
+  }
+}
+
+#ifdef ESPCONNECT_ETH_SUPPORT
+void Soylent::ESPConnect::_startEthernet() {
+  // Ethernet is kept up for the whole session, even when WiFi is connected, so that failover is immediate
+  if (_ethStarted || _isReplaying())
+    return;
+  if (_ethAutoStart) {
+    LOGI(TAG, "Starting Ethernet...");
+    _ethStarted = ETH.begin();
+  } else {
+    // started by the application with its own PHY configuration: only watched
+    LOGI(TAG, "Watching Ethernet started by the application");
+    _ethStarted = true;
+  }
+}
+#endif
+
+// the active interface changed while connected: reported as NETWORK_CONNECTED => NETWORK_CONNECTED, getMode() tells the new one
+void Soylent::ESPConnect::_switchActiveMode(Soylent::ESPConnect::Mode mode) {
+  if (_state != Soylent::ESPConnect::State::NETWORK_CONNECTED || _activeMode == mode)
+    return;
+  _activeMode = mode;
+#ifdef ESPCONNECT_TRACE
+  _record(Soylent::ESPConnect::TraceType::STATE, static_cast<uint8_t>(_state));
+#endif
+  _updateMDNS();
+  if (_callback != nullptr)
+    _callback(_state, _state);
+}
+
+// interfaces by priority: ETH first, then STA. The portal (AP) is the last resort handled by the state machine.
+Soylent::ESPConnect::Mode Soylent::ESPConnect::_failoverMode() const {
+  if (_hasIP(Soylent::ESPConnect::Mode::ETH))
+    return Soylent::ESPConnect::Mode::ETH;
+  if (_hasIP(Soylent::ESPConnect::Mode::STA))
+    return Soylent::ESPConnect::Mode::STA;
+  return Soylent::ESPConnect::Mode::NONE;
+}
+
+void Soylent::ESPConnect::_roam() {
+  if (_isReplaying())
+    return;
+
+  // background scan finished ?
+  if (_roamScanning) {
+    const int16_t n = WiFi.scanComplete();
+    if (n == WIFI_SCAN_RUNNING)
+      return;
+    _roamScanning = false;
+
+    const int8_t current = WiFi.RSSI();
+    const uint8_t* currentBSSID = WiFi.BSSID();
+    int best = -1;
+    for (int i = 0; i < n; ++i) {
+      if (WiFi.SSID(i) != _config.wifiSSID.c_str())
+        continue;
+      if (currentBSSID != nullptr && memcmp(WiFi.BSSID(i), currentBSSID, 6) == 0)
+        continue;
+      if (WiFi.RSSI(i) < current + _roamHysteresis)
+        continue;
+      if (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best))
+        best = i;
+    }
+
+    if (best >= 0) {
+      LOGI(TAG, "Roaming from %d dBm to BSSID: %s (%d dBm) on channel %d", current, WiFi.BSSIDstr(best).c_str(), WiFi.RSSI(best), WiFi.channel(best));
+      _roamPendingGain = WiFi.RSSI(best) - current;
+      _roamPinned = true;
+      _roamSkipReconnect = true;
+      WiFi.begin(_config.wifiSSID.c_str(), _psk(), WiFi.channel(best), WiFi.BSSID(best));
+    }
+
+    WiFi.scanDelete();
+    return;
+  }
+
+  // use the smoothed RSSI so that a single bad sample does not trigger a scan
+  const int8_t rssi = _linkStats.samples > 0 ? _linkStats.ewma : WiFi.RSSI();
+  if (rssi == 0 || rssi >= _roamThreshold)
+    return;
+
+  // low-duty background scans: at most one per interval
+  if (_isScheduled(Soylent::ESPConnect::Timer::ROAM_HOLDOFF))
+    return;
+  _schedule(Soylent::ESPConnect::Timer::ROAM_HOLDOFF, _roamInterval * 1000);
+
+  LOGD(TAG, "RSSI %d dBm below %d dBm: scanning for SSID: %s...", rssi, _roamThreshold, _config.wifiSSID.c_str());
+  WiFi.scanDelete();
+  _roamScanning = WiFi.scanNetworks(true, false, false, 100, 0, _config.wifiSSID.c_str(), nullptr) == WIFI_SCAN_RUNNING;
+}
+
+void Soylent::ESPConnect::_sampleLink() {
+  if (_isReplaying())
+    return;
+
+  const int8_t rssi = WiFi.RSSI();
+  if (rssi == 0)
+    return;
+
+  _rssiWindow[_rssiHead] = rssi;
+  _rssiHead = (_rssiHead + 1) % ESPCONNECT_RSSI_WINDOW;
+  if (_linkStats.samples < ESPCONNECT_RSSI_WINDOW)
+    _linkStats.samples++;
+
+  // EWMA with alpha = 1/8, in 1/16 dBm to keep the precision
+  if (_linkStats.samples == 1)
+    _rssiEwma = rssi * 16;
+  else
+    _rssiEwma += (rssi * 16 - _rssiEwma) / 8;
+
+  // the window is small: sort a copy once per sample so that reads are O(1)
+  int8_t sorted[ESPCONNECT_RSSI_WINDOW];
+  memcpy(sorted, _rssiWindow, _linkStats.samples);
+  std::sort(sorted, sorted + _linkStats.samples);
+
+  const uint16_t n = _linkStats.samples;
+  _linkStats.ewma = _rssiEwma / 16;
+  _linkStats.min = sorted[0];
+  _linkStats.max = sorted[n - 1];
+  _linkStats.p10 = sorted[(n - 1) * 10 / 100];
+  _linkStats.p50 = sorted[(n - 1) * 50 / 100];
+  _linkStats.p90 = sorted[(n - 1) * 90 / 100];
+  _linkStats.quality = _wifiSignalQuality(_linkStats.ewma);
+  _updateDisconnectRate();
+}
+
+void Soylent::ESPConnect::_recordDisconnect() {
+  if (_isReplaying())
+    return;
+
+  _disconnectTimes[_disconnectHead] = _now();
+  _disconnectHead = (_disconnectHead + 1) % ESPCONNECT_DISCONNECT_HISTORY;
+  if (_disconnectCount < ESPCONNECT_DISCONNECT_HISTORY)
+    _disconnectCount++;
+  _updateDisconnectRate();
+}
+
+void Soylent::ESPConnect::_updateDisconnectRate() {
+  const uint32_t now = _now();
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < _disconnectCount; i++) {
+    if (now - _disconnectTimes[i] < 3600000)
+      count++;
+  }
+  _linkStats.disconnectRate = count;
+}
+
+void Soylent::ESPConnect::_adaptPower() {
+  const uint32_t now = _now();
+
+  // STA traffic keeps the modem awake like markActivity() does
+  const uint32_t packets = trafficHooks[0].rxPackets.load(std::memory_order_relaxed) + trafficHooks[0].txPackets.load(std::memory_order_relaxed);
+  if (packets - _powerPackets >= ESPCONNECT_POWER_ACTIVITY_PACKETS)
+    _lastActivity = now;
+  _powerPackets = packets;
+
+  wifi_ps_type_t target = WIFI_PS_NONE;
+  if (_powerProfile != Soylent::ESPConnect::PowerProfile::LATENCY && _latencyBudget >= ESPCONNECT_MIN_MODEM_LATENCY) {
+    const bool idle = now - _lastActivity >= ESPCONNECT_POWER_IDLE_TIME;
+    const wifi_ps_type_t deepest = _latencyBudget >= ESPCONNECT_MAX_MODEM_LATENCY ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM;
+    if (_powerProfile == Soylent::ESPConnect::PowerProfile::BALANCED)
+      target = idle ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE;
+    else
+      target = idle ? deepest : WIFI_PS_MIN_MODEM;
+  }
+
+  if (target != _powerMode)
+    _setPowerMode(target);
+}
+
+Soylent::ESPConnect::TrafficStats Soylent::ESPConnect::getTrafficStats(Soylent::ESPConnect::Mode mode) const {
+  Lock lock(this);
+  switch (mode) {
+    case Soylent::ESPConnect::Mode::STA:
+      return _trafficStats[0];
+#ifdef ESPCONNECT_ETH_SUPPORT
+    case Soylent::ESPConnect::Mode::ETH:
+      return _trafficStats[1];
+#endif
+    default:
+      return {};
+  }
+}
+
+void Soylent::ESPConnect::_sampleTraffic() {
+  if (_isReplaying())
+    return;
+
+  // also wraps an interface connected after the others
+  tcpip_callback(hookTraffic, nullptr);
+
+  const uint32_t now = _now();
+  const uint32_t elapsed = now - _trafficSampled;
+  _trafficSampled = now;
+
+  for (size_t i = 0; i < 2; i++) {
+    const TrafficHook& hook = trafficHooks[i];
+    Soylent::ESPConnect::TrafficStats& stats = _trafficStats[i];
+    const uint32_t rxBytes = hook.rxBytes.load(std::memory_order_relaxed);
+    const uint32_t txBytes = hook.txBytes.load(std::memory_order_relaxed);
+    const uint32_t rxPackets = hook.rxPackets.load(std::memory_order_relaxed);
+    const uint32_t txPackets = hook.txPackets.load(std::memory_order_relaxed);
+    const uint32_t rxDrops = hook.rxDrops.load(std::memory_order_relaxed);
+    const uint32_t txDrops = hook.txDrops.load(std::memory_order_relaxed);
+    stats.rxBytesRate = perSecond(rxBytes - stats.rxBytes, elapsed);
+    stats.txBytesRate = perSecond(txBytes - stats.txBytes, elapsed);
+    stats.rxPacketsRate = perSecond(rxPackets - stats.rxPackets, elapsed);
+    stats.txPacketsRate = perSecond(txPackets - stats.txPackets, elapsed);
+    stats.rxDropRate = perThousand(rxDrops - stats.rxDrops, rxDrops - stats.rxDrops + rxPackets - stats.rxPackets);
+    stats.txDropRate = perThousand(txDrops - stats.txDrops, txDrops - stats.txDrops + txPackets - stats.txPackets);
+    stats.rxBytes = rxBytes;
+    stats.txBytes = txBytes;
+    stats.rxPackets = rxPackets;
+    stats.txPackets = txPackets;
+    stats.rxDrops = rxDrops;
+    stats.txDrops = txDrops;
+  }
+
+#if LWIP_STATS && TCP_STATS
+  // lwIP counters are 16 bits wide unless LWIP_STATS_LARGE: deltas are computed in their own width
+  typedef decltype(lwip_stats.tcp.xmit) StatCounter;
+  const StatCounter rexmit = static_cast<StatCounter>(lwip_stats.tcp.rexmit - static_cast<StatCounter>(_tcpRexmitLast));
+  const StatCounter xmit = static_cast<StatCounter>(lwip_stats.tcp.xmit - static_cast<StatCounter>(_tcpXmitLast));
+  _tcpRexmitLast = lwip_stats.tcp.rexmit;
+  _tcpXmitLast = lwip_stats.tcp.xmit;
+  _tcpRetransmits += rexmit;
+  _tcpRetransmitRate = perThousand(rexmit, xmit);
+#endif
+}
+
+void Soylent::ESPConnect::_setPowerMode(wifi_ps_type_t mode) {
+  if (_isReplaying())
+    return;
+
+  const uint32_t now = _now();
+  _powerModeDurations[_powerMode] += now - _powerModeSince;
+  _powerModeSince = now;
+  if (mode != _powerMode) {
+    LOGD(TAG, "Modem sleep: %s => %s", PowerModeNames[_powerMode], PowerModeNames[mode]);
+    _powerMode = mode;
+  }
+  WiFi.setSleep(mode);
+}
+
+void Soylent::ESPConnect::addMDNSService(const char* service, const char* proto, uint16_t port) {
+  Lock lock(this);
+  Soylent::ESPConnect::MDNSService* entry = _findMDNSService(service, proto);
+  if (entry == nullptr) {
+    _mdnsServices.push_back({service, proto, port, {}});
+  } else if (entry->port == port) {
+    return;
+  } else {
+    entry->port = port;
+#ifndef ESPCONNECT_NO_MDNS
+    if (_mdnsStarted)
+      mdns_service_remove(("_" + entry->service).c_str(), ("_" + entry->proto).c_str());
+#endif
+  }
+#ifndef ESPCONNECT_NO_MDNS
+  if (_mdnsStarted) {
+    entry = _findMDNSService(service, proto);
+    MDNS.addService(service, proto, port);
+    for (const auto& item : entry->txt)
+      MDNS.addServiceTxt(service, proto, item.first.c_str(), item.second.c_str());
+  }
+#endif
+}
+
+void Soylent::ESPConnect::addMDNSServiceTxt(const char* service, const char* proto, const char* key, const char* value) {
+  Lock lock(this);
+  Soylent::ESPConnect::MDNSService* entry = _findMDNSService(service, proto);
+  if (entry == nullptr)
+    return;
+  auto item = std::find_if(entry->txt.begin(), entry->txt.end(), [key](const std::pair<std::string, std::string>& i) { return i.first == key; });
+  if (item == entry->txt.end())
+    entry->txt.emplace_back(key, value);
+  else if (item->second == value)
+    return;
+  else
+    item->second = value;
+#ifndef ESPCONNECT_NO_MDNS
+  if (_mdnsStarted)
+    MDNS.addServiceTxt(service, proto, key, value);
+#endif
+}
+
+void Soylent::ESPConnect::removeMDNSService(const char* service, const char* proto) {
+  Lock lock(this);
+  auto entry = std::find_if(_mdnsServices.begin(), _mdnsServices.end(), [service, proto](const Soylent::ESPConnect::MDNSService& s) { return s.service == service && s.proto == proto; });
+  if (entry == _mdnsServices.end())
+    return;
+  _mdnsServices.erase(entry);
+#ifndef ESPCONNECT_NO_MDNS
+  if (_mdnsStarted)
+    mdns_service_remove((std::string("_") + service).c_str(), (std::string("_") + proto).c_str());
+#endif
+}
+
+Soylent::ESPConnect::MDNSService* Soylent::ESPConnect::_findMDNSService(const char* service, const char* proto) {
+  for (auto& entry : _mdnsServices)
+    if (entry.service == service && entry.proto == proto)
+      return &entry;
+  return nullptr;
+}
+
+// The responder is started once and kept running until end(): it follows the interfaces going up and down
+// and re-announces by itself, whereas restarting it on each reconnect drops all services and delays discovery.
+void Soylent::ESPConnect::_startMDNS() {
+#ifndef ESPCONNECT_NO_MDNS
+  if (_mdnsStarted || _isReplaying())
+    return;
+  if (!MDNS.begin(_hostname.c_str())) {
+    LOGE(TAG, "Failed to start mDNS");
+    return;
+  }
+  _mdnsStarted = true;
+  _mdnsState = nullptr;
+  _mdnsMode = nullptr;
+  MDNS.addService("espconnect", "tcp", 80);
+  MDNS.addServiceTxt("espconnect", "tcp", "version", ESPCONNECT_VERSION);
+  _updateMDNS();
+  for (const auto& entry : _mdnsServices) {
+    MDNS.addService(entry.service.c_str(), entry.proto.c_str(), entry.port);
+    for (const auto& item : entry.txt)
+      MDNS.addServiceTxt(entry.service.c_str(), entry.proto.c_str(), item.first.c_str(), item.second.c_str());
+  }
+#endif
+}
+
+// publishes state and mode changes in the TXT records, each change being announced by the responder
+void Soylent::ESPConnect::_updateMDNS() {
+#ifndef ESPCONNECT_NO_MDNS
+  if (!_mdnsStarted)
+    return;
+  const char* state = getStateName();
+  if (state != _mdnsState) {
+    _mdnsState = state;
+    MDNS.addServiceTxt("espconnect", "tcp", "state", state);
+  }
+  const char* mode = ModeName(getMode());
+  if (mode != _mdnsMode) {
+    _mdnsMode = mode;
+    MDNS.addServiceTxt("espconnect", "tcp", "mode", mode);
+  }
+#endif
+}
+
+void Soylent::ESPConnect::_probePassed() {
+  if (_probeStatus == Soylent::ESPConnect::ProbeStatus::RUNNING) {
+    _probeRTT = millis() - _probeStart;
+    _probeStatus = Soylent::ESPConnect::ProbeStatus::PASSED;
+    _wake();
+  }
+}
+
+void Soylent::ESPConnect::_startProbe() {
+  // nothing to probe in a replay: ready once connected
+  if (_isReplaying()) {
+    _probeStatus = Soylent::ESPConnect::ProbeStatus::PASSED;
+    return;
+  }
+
+  _stopProbe();
+  _probeStart = millis();
+  _probeStatus = Soylent::ESPConnect::ProbeStatus::RUNNING;
+
+  switch (_readinessProbe) {
+    case Soylent::ESPConnect::ReadinessProbe::GATEWAY: {
+#ifdef ESPCONNECT_ETH_SUPPORT
+      const IPAddress gateway = _activeMode == Soylent::ESPConnect::Mode::ETH ? ETH.gatewayIP() : WiFi.gatewayIP();
+#else
+      const IPAddress gateway = WiFi.gatewayIP();
+#endif
+      esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+      ip_addr_set_ip4_u32(&config.target_addr, static_cast<uint32_t>(gateway));
+      config.count = 1;
+      config.timeout_ms = ESPCONNECT_READINESS_TIMEOUT;
+      esp_ping_callbacks_t callbacks = {};
+      callbacks.cb_args = this;
+      callbacks.on_ping_success = [](__unused esp_ping_handle_t session, void* args) { static_cast<Soylent::ESPConnect*>(args)->_probePassed(); };
+      esp_ping_handle_t session;
+      if (esp_ping_new_session(&config, &callbacks, &session) == ESP_OK) {
+        _pingSession = session;
+        esp_ping_start(session);
+      }
+      break;
+    }
+
+    case Soylent::ESPConnect::ReadinessProbe::DNS:
+      // dns_gethostbyname() must run in the lwIP thread
+      tcpip_callback(_probeDNS, this);
+      break;
+
+    case Soylent::ESPConnect::ReadinessProbe::TCP:
+      if (_probeClient == nullptr) {
+        _probeClient = new AsyncClient();
+        _probeClient->onConnect([this](__unused void* arg, AsyncClient* client) {
+          _probePassed();
+          client->close();
+        });
+      }
+      _probeClient->connect(_readinessHost.c_str(), _readinessPort);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// the DNS probe queries the DNS server directly: dns_gethostbyname() could answer from the lwIP cache, filled by the DNS cache warm-up.
+// Only used in the lwIP thread.
+static struct udp_pcb* probePcb = nullptr;
+static uint16_t probeQueryId = 0;
+
+static void closeProbeDNS(__unused void* ctx) {
+  if (probePcb != nullptr) {
+    udp_remove(probePcb);
+    probePcb = nullptr;
+  }
+}
+
+// runs in the lwIP thread
+void Soylent::ESPConnect::_probeDNS(void* ctx) {
+  Soylent::ESPConnect* self = static_cast<Soylent::ESPConnect*>(ctx);
+  const std::string& host = self->_readinessHost;
+  const ip_addr_t* server = dns_getserver(0);
+  if (server == nullptr || ip_addr_isany(server) || host.empty() || host.length() > 253)
+    return;
+
+  // header (id, recursion desired, 1 question), QNAME, QTYPE A, QCLASS IN
+  const size_t qname = host.length() + 2;
+  struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, 12 + qname + 4, PBUF_RAM);
+  if (p == nullptr)
+    return;
+  uint8_t* query = static_cast<uint8_t*>(p->payload);
+  probeQueryId = static_cast<uint16_t>(esp_random());
+  const uint8_t header[12] = {static_cast<uint8_t>(probeQueryId >> 8), static_cast<uint8_t>(probeQueryId), 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+  memcpy(query, header, sizeof(header));
+  // each label of the hostname prefixed by its length
+  size_t label = sizeof(header);
+  for (size_t i = 0; i <= host.length(); i++) {
+    const size_t pos = sizeof(header) + 1 + i;
+    if (i < host.length() && host[i] != '.') {
+      query[pos] = host[i];
+      continue;
+    }
+    const size_t length = pos - label - 1;
+    if (length == 0 || length > 63) {
+      pbuf_free(p);
+      return;
+    }
+    query[label] = length;
+    label = pos;
+  }
+  query[label] = 0;
+  const uint8_t question[4] = {0x00, 0x01, 0x00, 0x01};
+  memcpy(query + sizeof(header) + qname, question, sizeof(question));
+
+  closeProbeDNS(nullptr);
+  probePcb = udp_new();
+  if (probePcb != nullptr) {
+    udp_recv(
+      probePcb,
+      [](void* arg, __unused struct udp_pcb* pcb, struct pbuf* answer, __unused const ip_addr_t* addr, __unused u16_t port) {
+        const uint8_t* response = static_cast<const uint8_t*>(answer->payload);
+        // answer (QR) to the last query, without error
+        if (answer->len >= 4 && ((response[0] << 8) | response[1]) == probeQueryId && (response[2] & 0x80) && (response[3] & 0x0F) == 0)
+          static_cast<Soylent::ESPConnect*>(arg)->_probePassed();
+        pbuf_free(answer);
+      },
+      self);
+    udp_sendto(probePcb, p, server, 53);
+  }
+  pbuf_free(p);
+}
+
+void Soylent::ESPConnect::_stopProbe() {
+  if (_pingSession != nullptr) {
+    esp_ping_stop(_pingSession);
+    esp_ping_delete_session(_pingSession);
+    _pingSession = nullptr;
+  }
+  // also aborts a connection still in progress
+  if (_probeClient != nullptr)
+    _probeClient->close(true);
+  if (_readinessProbe == Soylent::ESPConnect::ReadinessProbe::DNS)
+    tcpip_callback(closeProbeDNS, nullptr);
+}
+
+// DNS cache entries are also written from the lwIP thread
+static portMUX_TYPE dnsLock = portMUX_INITIALIZER_UNLOCKED;
+
+void Soylent::ESPConnect::_onDNSFound(__unused const char* name, const ip_addr_t* addr, void* arg) {
+  Soylent::ESPConnect::DNSCacheEntry* entry = static_cast<Soylent::ESPConnect::DNSCacheEntry*>(arg);
+  portENTER_CRITICAL(&dnsLock);
+  if (addr != nullptr && IP_IS_V4(addr)) {
+    entry->ip = ip4_addr_get_u32(ip_2_ip4(addr));
+    entry->status = Soylent::ESPConnect::DNSCacheEntry::Status::FRESH;
+  } else {
+    entry->status = Soylent::ESPConnect::DNSCacheEntry::Status::UNRESOLVED;
+  }
+  portEXIT_CRITICAL(&dnsLock);
+}
+
+bool Soylent::ESPConnect::addDNSHostname(const char* hostname) {
+  Lock lock(this);
+  if (strlen(hostname) >= ESPCONNECT_DNS_HOSTNAME_LENGTH)
+    return false;
+  if (_findDNSEntry(hostname) != nullptr)
     return true;
+  for (auto& entry : _dnsCache) {
+    if (entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::FREE) {
+      strncpy(entry.hostname, hostname, sizeof(entry.hostname));
+      entry.ip = 0;
+      entry.expires = 0;
+      entry.status = Soylent::ESPConnect::DNSCacheEntry::Status::UNRESOLVED;
+      // already connected ? resolve now
+      if (_state == Soylent::ESPConnect::State::NETWORK_CONNECTED)
+        _warmDNSCache();
+      return true;
+    }
   }
   return false;
 }
 
+bool Soylent::ESPConnect::resolve(const char* hostname, IPAddress& ip) {
+  Soylent::ESPConnect::DNSCacheEntry* entry;
+  {
+    Lock lock(this);
+    _updateDNSCache();
+    entry = _findDNSEntry(hostname);
+    if (entry != nullptr && entry->status == Soylent::ESPConnect::DNSCacheEntry::Status::RESOLVED && static_cast<int32_t>(entry->expires - _now()) > 0) {
+      ip = entry->ip;
+      return true;
+    }
+  }
+
+  // not locked: the lookup can take seconds
+  if (!WiFi.hostByName(hostname, ip))
+    return false;
+
+  // keep the result if the hostname is registered and not being resolved in the background
+  Lock lock(this);
+  if (entry != nullptr) {
+    portENTER_CRITICAL(&dnsLock);
+    if (entry->status != Soylent::ESPConnect::DNSCacheEntry::Status::PENDING) {
+      entry->ip = ip;
+      entry->expires = _now() + _dnsTTL * 1000;
+      entry->status = Soylent::ESPConnect::DNSCacheEntry::Status::RESOLVED;
+    }
+    portEXIT_CRITICAL(&dnsLock);
+  }
+  return true;
+}
+
+Soylent::ESPConnect::DNSCacheEntry* Soylent::ESPConnect::_findDNSEntry(const char* hostname) {
+  for (auto& entry : _dnsCache)
+    if (entry.status != Soylent::ESPConnect::DNSCacheEntry::Status::FREE && strcasecmp(entry.hostname, hostname) == 0)
+      return &entry;
+  return nullptr;
+}
+
+// Starts the lookup of the registered hostnames not resolved yet or expired.
+// Addresses still valid are kept across reconnects: the first requests after a reconnect do not wait for DNS.
+void Soylent::ESPConnect::_warmDNSCache() {
+  if (_isReplaying())
+    return;
+
+  const uint32_t now = _now();
+  bool lookup = false;
+  portENTER_CRITICAL(&dnsLock);
+  for (auto& entry : _dnsCache) {
+    if (entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::UNRESOLVED || (entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::RESOLVED && static_cast<int32_t>(entry.expires - now) <= 0)) {
+      entry.status = Soylent::ESPConnect::DNSCacheEntry::Status::PENDING;
+      lookup = true;
+    }
+  }
+  portEXIT_CRITICAL(&dnsLock);
+  // dns_gethostbyname() must run in the lwIP thread
+  if (lookup && tcpip_callback(_lookupDNSEntries, this) != ERR_OK) {
+    portENTER_CRITICAL(&dnsLock);
+    for (auto& entry : _dnsCache)
+      if (entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::PENDING)
+        entry.status = Soylent::ESPConnect::DNSCacheEntry::Status::UNRESOLVED;
+    portEXIT_CRITICAL(&dnsLock);
+  }
+}
+
+// runs in the lwIP thread
+void Soylent::ESPConnect::_lookupDNSEntries(void* ctx) {
+  Soylent::ESPConnect* self = static_cast<Soylent::ESPConnect*>(ctx);
+  for (auto& entry : self->_dnsCache) {
+    portENTER_CRITICAL(&dnsLock);
+    const bool pending = entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::PENDING;
+    portEXIT_CRITICAL(&dnsLock);
+    if (!pending)
+      continue;
+    ip_addr_t addr;
+    const err_t err = dns_gethostbyname(entry.hostname, &addr, _onDNSFound, &entry);
+    if (err == ERR_OK) {
+      // answered from the lwIP cache
+      _onDNSFound(entry.hostname, &addr, &entry);
+    } else if (err != ERR_INPROGRESS) {
+      _onDNSFound(entry.hostname, nullptr, &entry);
+    }
+  }
+}
+
+// sets the expiry of the addresses resolved in the lwIP thread
+void Soylent::ESPConnect::_updateDNSCache() {
+  const uint32_t now = _now();
+  portENTER_CRITICAL(&dnsLock);
+  for (auto& entry : _dnsCache) {
+    if (entry.status == Soylent::ESPConnect::DNSCacheEntry::Status::FRESH) {
+      entry.expires = now + _dnsTTL * 1000;
+      entry.status = Soylent::ESPConnect::DNSCacheEntry::Status::RESOLVED;
+    }
+  }
+  portEXIT_CRITICAL(&dnsLock);
+}
+
+#ifdef ESPCONNECT_TRACE
+static const uint8_t TraceMagic[] = {'E', 'C', 'T', '2'};
+
+void Soylent::ESPConnect::_record(Soylent::ESPConnect::TraceType type, uint8_t arg) {
+  if (_replaying)
+    return;
+  portENTER_CRITICAL(&_traceLock);
+  const uint32_t now = _now();
+  uint32_t delta = now - _traceLast;
+  _traceLast = now;
+  do {
+    const uint16_t step = std::min<uint32_t>(delta, UINT16_MAX);
+    delta -= step;
+    _traceRecords[_traceHead] = {step, delta > 0 ? Soylent::ESPConnect::TraceType::GAP : type, delta > 0 ? static_cast<uint8_t>(0) : arg};
+    _traceHead = (_traceHead + 1) % ESPCONNECT_TRACE_SIZE;
+    if (_traceCount < ESPCONNECT_TRACE_SIZE)
+      _traceCount++;
+  } while (delta > 0);
+  portEXIT_CRITICAL(&_traceLock);
+}
+
+void Soylent::ESPConnect::clearTrace() {
+  portENTER_CRITICAL(&_traceLock);
+  _traceHead = 0;
+  _traceCount = 0;
+  _traceLoops = 0;
+  _traceLast = _now();
+  portEXIT_CRITICAL(&_traceLock);
+}
+
+// format: "ECT2", the 8-byte TraceHeader, then 4-byte records (little-endian uint16 delta, type, arg)
+size_t Soylent::ESPConnect::dumpTrace(Print& out) const {
+  size_t written = out.write(TraceMagic, sizeof(TraceMagic));
+  written += out.write(reinterpret_cast<const uint8_t*>(&_traceHeader), sizeof(TraceHeader));
+  // copied in chunks so that the lock is never held while writing to out
+  TraceRecord chunk[16];
+  portENTER_CRITICAL(&_traceLock);
+  size_t count = _traceCount;
+  size_t index = (_traceHead + ESPCONNECT_TRACE_SIZE - _traceCount) % ESPCONNECT_TRACE_SIZE;
+  portEXIT_CRITICAL(&_traceLock);
+  while (count > 0) {
+    const size_t n = std::min(count, sizeof(chunk) / sizeof(chunk[0]));
+    portENTER_CRITICAL(&_traceLock);
+    for (size_t i = 0; i < n; i++)
+      chunk[i] = _traceRecords[(index + i) % ESPCONNECT_TRACE_SIZE];
+    portEXIT_CRITICAL(&_traceLock);
+    written += out.write(reinterpret_cast<const uint8_t*>(chunk), n * sizeof(TraceRecord));
+    index = (index + n) % ESPCONNECT_TRACE_SIZE;
+    count -= n;
+  }
+  return written;
+}
+
+bool Soylent::ESPConnect::replayTrace(const uint8_t* trace, size_t len, ReplayCallback callback) {
+  static_assert(sizeof(TraceRecord) == 4, "TraceRecord must be packed in 4 bytes");
+  static_assert(sizeof(TraceHeader) == 8, "TraceHeader must be packed in 8 bytes");
+  const size_t start = sizeof(TraceMagic) + sizeof(TraceHeader);
+  if (len < start || memcmp(trace, TraceMagic, sizeof(TraceMagic)) != 0 || (len - start) % sizeof(TraceRecord) != 0)
+    return false;
+
+  // the replay drives the state machine: it must not be running already, nor in its own task
+  if (_state != Soylent::ESPConnect::State::NETWORK_DISABLED || _taskMode) {
+    LOGW(TAG, "Trace replay needs a stopped ESPConnect without task mode");
+    return false;
+  }
+
+  LOGI(TAG, "Replaying trace of %u records...", static_cast<unsigned>((len - start) / sizeof(TraceRecord)));
+
+  TraceHeader header;
+  memcpy(&header, trace + sizeof(TraceMagic), sizeof(TraceHeader));
+
+  // nothing of the replay is kept: NVS and RTC memory are left untouched and the application listener is not called
+  uint32_t virtualNow = 0;
+  const ClockSource clock = _clock;
+  const Soylent::ESPConnect::StateCallback stateCallback = _callback;
+  const bool pmkCache = _pmkCache;
+  const bool fastWake = _fastWake;
+  const WakeCache retained = wakeCache;
+  const auto timers = _timers;
+  const uint32_t connectTimeout = _connectTimeout;
+  const uint32_t portalTimeout = _portalTimeout;
+  const bool backgroundRetry = _backgroundRetry;
+  Soylent::ESPConnect::Config config;
+  {
+    // the snapshots are not published: getConfig() keeps returning the configuration of the stopped instance
+    Lock configLock(_configMutex);
+    config = _config;
+    // only whether a SSID is configured matters to the state machine, the WiFi calls being stubbed out
+    _config = {header.flags & TraceHeader::WIFI_SSID ? "replay" : "", "", (header.flags & TraceHeader::AP_MODE) != 0};
+  }
+  _connectTimeout = header.connectTimeout;
+  _portalTimeout = header.portalTimeout;
+  _backgroundRetry = header.flags & TraceHeader::BACKGROUND_RETRY;
+  _clock = [&virtualNow]() { return virtualNow; };
+  _callback = nullptr;
+  _pmkCache = false;
+  _fastWake = false;
+  _replayIPs = 0;
+  _replaying = true;
+  _replayCallback = callback;
+
+  // same starting point as begin()
+  _timers.reset(_now());
+  _activeMode = Soylent::ESPConnect::Mode::NONE;
+  _retryMode = Soylent::ESPConnect::Mode::NONE;
+  _state = Soylent::ESPConnect::State::NETWORK_ENABLED;
+
+  for (size_t offset = start; offset < len; offset += sizeof(TraceRecord)) {
+    TraceRecord record;
+    memcpy(&record, trace + offset, sizeof(TraceRecord));
+    switch (record.type) {
+      case Soylent::ESPConnect::TraceType::LOOP: {
+        // spread the loop() calls over the recorded interval
+        const uint32_t end = virtualNow + record.delta;
+        for (uint8_t i = 1; i <= record.arg; i++) {
+          virtualNow = end - record.delta + record.delta * i / record.arg;
+          loop();
+        }
+        virtualNow = end;
+        break;
+      }
+      case Soylent::ESPConnect::TraceType::EVENT:
+        virtualNow += record.delta;
+        _onWiFiEvent(static_cast<WiFiEvent_t>(record.arg));
+        break;
+      default:
+        // recorded state changes are only there to compare with the replayed ones
+        virtualNow += record.delta;
+        break;
+    }
+  }
+
+  LOGI(TAG, "Replay done after %" PRIu32 " ms in state %s", virtualNow, getStateName());
+
+  // stop the replayed state machine and restore the stopped instance
+  _replayCallback = nullptr;
+  _teardown();
+  _replaying = false;
+  {
+    Lock configLock(_configMutex);
+    _config = config;
+  }
+  _connectTimeout = connectTimeout;
+  _portalTimeout = portalTimeout;
+  _backgroundRetry = backgroundRetry;
+  _clock = clock;
+  _callback = stateCallback;
+  _pmkCache = pmkCache;
+  _fastWake = fastWake;
+  wakeCache = retained;
+  _timers = timers;
+  return true;
+}
+#endif
+
+void Soylent::ESPConnect::_saveWakeCache() {
+  // connected with the retained connection, config not loaded yet: the retained credentials are kept
+  if (!_configDeferred) {
+    if (_config.wifiSSID.length() >= sizeof(wakeCache.ssid))
+      return;
+    // the passphrase is not retained: wait for its PMK, derived in loop()
+    if (!_config.wifiPassword.empty() && _pmk.length() + 1 != sizeof(wakeCache.pmk)) {
+      wakeCache.magic = 0;
+      return;
+    }
+  }
+
+  const uint32_t hash = wakeHash(_hostname.c_str(), _ipConfig);
+
+  // keep the expiry of a reused lease, otherwise renew at half of the new lease like DHCP does (T1)
+  time_t leaseExpiry = 0;
+  if (!_ipConfig.ip) {
+    if (_leaseReused && wakeCache.leaseExpiry > time(nullptr)) {
+      leaseExpiry = wakeCache.leaseExpiry;
+    } else {
+      const uint32_t lease = dhcpLeaseTime();
+      leaseExpiry = lease > 0 ? time(nullptr) + lease / 2 : 0;
+    }
+  }
+
+  wakeCache.magic = 0;
+  wakeCache.hash = hash;
+  if (!_configDeferred) {
+    wakeCache.credentials = pmkId(_config.wifiSSID, _config.wifiPassword);
+    strncpy(wakeCache.ssid, _config.wifiSSID.c_str(), sizeof(wakeCache.ssid));
+    strncpy(wakeCache.pmk, _config.wifiPassword.empty() ? "" : _pmk.c_str(), sizeof(wakeCache.pmk));
+  }
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid != nullptr)
+    memcpy(wakeCache.bssid, bssid, sizeof(wakeCache.bssid));
+  wakeCache.channel = WiFi.channel();
+  wakeCache.ip = WiFi.localIP();
+  wakeCache.gateway = WiFi.gatewayIP();
+  wakeCache.subnet = WiFi.subnetMask();
+  wakeCache.dns = WiFi.dnsIP();
+  wakeCache.leaseExpiry = leaseExpiry;
+  wakeCache.magic = bssid != nullptr ? WAKE_CACHE_MAGIC : 0;
+}
+
+void Soylent::ESPConnect::_loadDeferredConfig() {
+  _configDeferred = false;
+  Soylent::ESPConnect::Config config = loadConfig();
+  // changed by someone else than ESPConnect, which drops the retained connection when it saves a config
+  if (config.apMode || config.wifiSSID != _config.wifiSSID || pmkId(config.wifiSSID, config.wifiPassword) != wakeCache.credentials) {
+    LOGW(TAG, "Config changed since the connection was retained: dropping it");
+    wakeCache.magic = 0;
+    _pmk.clear();
+    _pmkDerived = false;
+  }
+  Lock lock(this);
+  Lock configLock(_configMutex);
+  _config = config;
+  _publishConfig();
+}
+
+void Soylent::ESPConnect::_softAP() {
+  if (_isReplaying())
+    return;
+
+  LOGD(TAG, "Access Point channel: %u (score: %" PRIu32 ")", _apChannel, _apChannelScore);
+  if (_apPassword.empty() || _apPassword.length() < 8) {
+    // Disabling invalid Access Point password which must be at least 8 characters long when set
+    WiFi.softAP(_apSSID.c_str(), "", _apChannel);
+  } else {
+    WiFi.softAP(_apSSID.c_str(), _apPassword.c_str(), _apChannel);
+  }
+}
+
+// Copies the finished scan into the scan cache, keeping the strongest access points,
+// then scores the channels from it and frees the scan results
+void Soylent::ESPConnect::_cacheScan() {
+  if (_isReplaying())
+    return;
+
+  const int n = WiFi.scanComplete();
+  if (n < 0)
+    return;
+  // filled aside: the readers copy the cache under the lock, which cannot be held while reading the scan results
+  Soylent::ESPConnect::ScanEntry entries[ESPCONNECT_SCAN_CACHE_SIZE];
+  uint8_t count = 0;
+  for (int i = 0; i < n; i++) {
+    const int8_t rssi = WiFi.RSSI(i);
+    uint8_t slot = count;
+    if (slot == ESPCONNECT_SCAN_CACHE_SIZE) {
+      // full: replace the weakest one
+      slot = 0;
+      for (uint8_t j = 1; j < count; j++)
+        if (entries[j].rssi < entries[slot].rssi)
+          slot = j;
+      if (entries[slot].rssi >= rssi)
+        continue;
+    } else {
+      count++;
+    }
+    Soylent::ESPConnect::ScanEntry& entry = entries[slot];
+    strncpy(entry.ssid, WiFi.SSID(i).c_str(), sizeof(entry.ssid) - 1);
+    entry.ssid[sizeof(entry.ssid) - 1] = '\0';
+    entry.rssi = rssi;
+    entry.channel = WiFi.channel(i);
+    entry.open = WiFi.encryptionType(i) == WIFI_AUTH_OPEN;
+  }
+  const uint32_t now = _now();
+  portENTER_CRITICAL(&_scanCacheLock);
+  memcpy(_scanCache, entries, count * sizeof(Soylent::ESPConnect::ScanEntry));
+  _scanCacheCount = count;
+  _scanCachedAt = now;
+  _scanCached = true;
+  portEXIT_CRITICAL(&_scanCacheLock);
+  _scanRequested = false;
+  LOGD(TAG, "Scan cached: %u access points", count);
+  _scoreChannels();
+  WiFi.scanDelete();
+}
+
+int Soylent::ESPConnect::_copyScanCache(Soylent::ESPConnect::ScanEntry* entries, uint32_t& cachedAt) const {
+  portENTER_CRITICAL(&_scanCacheLock);
+  const int count = _scanCached ? _scanCacheCount : -1;
+  if (count > 0)
+    memcpy(entries, _scanCache, count * sizeof(Soylent::ESPConnect::ScanEntry));
+  cachedAt = _scanCachedAt;
+  portEXIT_CRITICAL(&_scanCacheLock);
+  return count;
+}
+
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+// Writes the scan entries into the scan response body, in the same format as the JSON response.
+// Control characters of the SSIDs are dropped, so that an entry never exceeds 128 bytes.
+// The writes are still bounded: an entry which does not fit anymore is left out with the following ones.
+size_t Soylent::ESPConnect::_writeScanResponse(const Soylent::ESPConnect::ScanEntry* entries, uint8_t count) {
+  // the last byte is kept for the closing bracket
+  char* const end = _scanResponse + sizeof(_scanResponse) - 1;
+  char* out = _scanResponse;
+  *out++ = '[';
+  for (uint8_t i = 0; i < count; i++) {
+    const Soylent::ESPConnect::ScanEntry& entry = entries[i];
+    char* const start = out;
+    int written = snprintf(out, end - out, "%s{\"name\":\"", i > 0 ? "," : "");
+    bool full = written < 0 || written >= end - out;
+    if (!full) {
+      out += written;
+      for (const char* c = entry.ssid; *c != '\0'; c++) {
+        if (static_cast<uint8_t>(*c) < 0x20)
+          continue;
+        const bool escaped = *c == '"' || *c == '\\';
+        if (end - out < (escaped ? 2 : 1)) {
+          full = true;
+          break;
+        }
+        if (escaped)
+          *out++ = '\\';
+        *out++ = *c;
+      }
+    }
+    if (!full) {
+      written = snprintf(out, end - out, "\",\"rssi\":%d,\"signal\":%d,\"open\":%s}", entry.rssi, _wifiSignalQuality(entry.rssi), entry.open ? "true" : "false");
+      full = written < 0 || written >= end - out;
+    }
+    if (full) {
+      out = start;
+      break;
+    }
+    out += written;
+  }
+  *out++ = ']';
+  return out - _scanResponse;
+}
+#endif
+
+// Scores channels from the scan cache: each BSS adds its signal strength (dB above -100 dBm),
+// weighted by the overlap of its 20 MHz channel with the scored one (4 for the same channel, down to 1 three channels away).
+void Soylent::ESPConnect::_scoreChannels() {
+  for (size_t c = 0; c < ESPCONNECT_AP_MAX_CHANNEL; c++)
+    _channelScores[c] = 0;
+  for (uint8_t i = 0; i < _scanCacheCount; i++) {
+    const int32_t channel = _scanCache[i].channel;
+    const uint32_t strength = std::max<int32_t>(0, std::min<int32_t>(70, _scanCache[i].rssi + 100));
+    for (int32_t c = 1; c <= ESPCONNECT_AP_MAX_CHANNEL; c++) {
+      const int32_t distance = std::abs(c - channel);
+      if (distance < 4)
+        _channelScores[c - 1] += (4 - distance) * strength;
+    }
+  }
+  _channelsScored = true;
+}
+
+// on equal scores, the non-overlapping channels 1, 6 and 11 are preferred
+uint8_t Soylent::ESPConnect::_bestChannel() const {
+  static const uint8_t preferred[] = {1, 6, 11};
+  uint8_t best = 0;
+  for (uint8_t channel : preferred)
+    if (channel <= ESPCONNECT_AP_MAX_CHANNEL && (best == 0 || _channelScores[channel - 1] < _channelScores[best - 1]))
+      best = channel;
+  for (uint8_t channel = 1; channel <= ESPCONNECT_AP_MAX_CHANNEL; channel++)
+    if (best == 0 || _channelScores[channel - 1] < _channelScores[best - 1])
+      best = channel;
+  return best;
+}
+
 void Soylent::ESPConnect::_scan() {
+  if (_isReplaying())
+    return;
+
   WiFi.scanDelete();
-  WiFi.scanNetworks(true, false, false, 500, 0, nullptr, nullptr);
+  WiFi.scanNetworks(true, false, false, ESPCONNECT_SCAN_DWELL, 0, nullptr, nullptr);
 }
@@ -8,8 +8,20 @@
 #include <AsyncJson.h>
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <lwip/ip_addr.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "./espconnect_timers.h"
+
 
 #define ESPCONNECT_VERSION          "0.1.0"
 #define ESPCONNECT_VERSION_MAJOR    0
@@ -24,8 +36,177 @@
   #define ESPCONNECT_PORTAL_TIMEOUT 180
 #endif
 
+// backoff (seconds) between two connection attempts to the configured WiFi while the captive portal runs
+#ifndef ESPCONNECT_RETRY_BACKOFF_MIN
+  #define ESPCONNECT_RETRY_BACKOFF_MIN 5
+#endif
+#ifndef ESPCONNECT_RETRY_BACKOFF_MAX
+  #define ESPCONNECT_RETRY_BACKOFF_MAX 60
+#endif
+
+// captive portal admission control: maximum number of responses in flight,
+// and per client IP token bucket (requests per second and burst)
+#ifndef ESPCONNECT_PORTAL_MAX_INFLIGHT
+  #define ESPCONNECT_PORTAL_MAX_INFLIGHT 4
+#endif
+#ifndef ESPCONNECT_PORTAL_RATE
+  #define ESPCONNECT_PORTAL_RATE 4
+#endif
+#ifndef ESPCONNECT_PORTAL_BURST
+  #define ESPCONNECT_PORTAL_BURST 8
+#endif
+// number of client IPs tracked by the rate limiter (least recently seen is evicted)
+#ifndef ESPCONNECT_PORTAL_CLIENTS
+  #define ESPCONNECT_PORTAL_CLIENTS 8
+#endif
+
+// task mode: core affinity, priority and stack size (bytes) of the ESPConnect task
+#ifndef ESPCONNECT_TASK_CORE
+  #define ESPCONNECT_TASK_CORE tskNO_AFFINITY
+#endif
+#ifndef ESPCONNECT_TASK_PRIORITY
+  #define ESPCONNECT_TASK_PRIORITY 2
+#endif
+// the stack is shared by the state machine (NVS writes, WiFi and mDNS start) and the state callback:
+// check its high-water mark with getMemoryStats().stackFreeLoop when the callback does more than a few calls
+#ifndef ESPCONNECT_TASK_STACK_SIZE
+  #define ESPCONNECT_TASK_STACK_SIZE 8192
+#endif
+// task mode: maximum sleep (ms) of the task between two runs, and polling period (ms) of the captive portal DNS server
+#ifndef ESPCONNECT_TASK_MAX_SLEEP
+  #define ESPCONNECT_TASK_MAX_SLEEP 500
+#endif
+#ifndef ESPCONNECT_TASK_DNS_PERIOD
+  #define ESPCONNECT_TASK_DNS_PERIOD 10
+#endif
+// task mode: number of WiFi events queued for the task
+#ifndef ESPCONNECT_TASK_QUEUE_SIZE
+  #define ESPCONNECT_TASK_QUEUE_SIZE 16
+#endif
+
+// PMK cache and fast wake: priority and stack size (bytes) of the one-shot task deriving the PMK (PBKDF2, a few hundred ms of CPU)
+#ifndef ESPCONNECT_PMK_TASK_PRIORITY
+  #define ESPCONNECT_PMK_TASK_PRIORITY 1
+#endif
+#ifndef ESPCONNECT_PMK_TASK_STACK_SIZE
+  #define ESPCONNECT_PMK_TASK_STACK_SIZE 4096
+#endif
+
+// soft AP channel selection: highest channel considered, and interval (s) between two re-evaluations while no station is connected
+#ifndef ESPCONNECT_AP_MAX_CHANNEL
+  #define ESPCONNECT_AP_MAX_CHANNEL 11
+#endif
+#ifndef ESPCONNECT_AP_CHANNEL_INTERVAL
+  #define ESPCONNECT_AP_CHANNEL_INTERVAL 60
+#endif
+
+// scan cache: number of access points kept for the captive portal,
+// active scan time (ms) per channel, and margin (ms) added to the worst case scan time (dwell time x channels of the country)
+// when scheduling the scan made by the connecting STA before the connect timeout,
+// and age (ms) after which the cache is dropped instead of being listed
+#ifndef ESPCONNECT_SCAN_CACHE_SIZE
+  #define ESPCONNECT_SCAN_CACHE_SIZE 16
+#endif
+#ifndef ESPCONNECT_SCAN_DWELL
+  #define ESPCONNECT_SCAN_DWELL 500
+#endif
+#ifndef ESPCONNECT_SCAN_PREFETCH_MARGIN
+  #define ESPCONNECT_SCAN_PREFETCH_MARGIN 1000
+#endif
+#ifndef ESPCONNECT_SCAN_CACHE_MAX_AGE
+  #define ESPCONNECT_SCAN_CACHE_MAX_AGE 60000
+#endif
+
+// timeout (ms) of a readiness probe, also the delay before the next attempt
+#ifndef ESPCONNECT_READINESS_TIMEOUT
+  #define ESPCONNECT_READINESS_TIMEOUT 1000
+#endif
+
+// DNS cache: number of hostnames, maximum hostname length and time to live (s) of the resolved addresses
+#ifndef ESPCONNECT_DNS_CACHE_SIZE
+  #define ESPCONNECT_DNS_CACHE_SIZE 8
+#endif
+#ifndef ESPCONNECT_DNS_HOSTNAME_LENGTH
+  #define ESPCONNECT_DNS_HOSTNAME_LENGTH 64
+#endif
+#ifndef ESPCONNECT_DNS_TTL
+  #define ESPCONNECT_DNS_TTL 300
+#endif
+
+// with ESPCONNECT_TRACE: number of 4-byte records kept by the event trace recorder,
+// and maximum period (ms) between two records of the loop() cadence
+#ifndef ESPCONNECT_TRACE_SIZE
+  #define ESPCONNECT_TRACE_SIZE 512
+#endif
+#ifndef ESPCONNECT_TRACE_LOOP_PERIOD
+  #define ESPCONNECT_TRACE_LOOP_PERIOD 100
+#endif
+
+// duration (ms) of the direct connection attempt after a deep sleep wake-up before falling back to a full connection
+#ifndef ESPCONNECT_FAST_WAKE_TIMEOUT
+  #define ESPCONNECT_FAST_WAKE_TIMEOUT 3000
+#endif
+
+#ifndef ESPCONNECT_ROAMING_RSSI_THRESHOLD
+  #define ESPCONNECT_ROAMING_RSSI_THRESHOLD -75
+#endif
+
+#ifndef ESPCONNECT_ROAMING_HYSTERESIS
+  #define ESPCONNECT_ROAMING_HYSTERESIS 8
+#endif
+
+#ifndef ESPCONNECT_ROAMING_INTERVAL
+  #define ESPCONNECT_ROAMING_INTERVAL 60
+#endif
+
+// number of RSSI samples kept to compute the link statistics
+#ifndef ESPCONNECT_RSSI_WINDOW
+  #define ESPCONNECT_RSSI_WINDOW 32
+#endif
+
+// interval (ms) between two RSSI samples
+#ifndef ESPCONNECT_RSSI_SAMPLE_INTERVAL
+  #define ESPCONNECT_RSSI_SAMPLE_INTERVAL 1000
+#endif
+
+// number of disconnection timestamps kept to compute the disconnection rate
+#ifndef ESPCONNECT_DISCONNECT_HISTORY
+  #define ESPCONNECT_DISCONNECT_HISTORY 16
+#endif
+
+// latency budget (ms) used by the BALANCED and LOW_POWER profiles
+#ifndef ESPCONNECT_LATENCY_BUDGET
+  #define ESPCONNECT_LATENCY_BUDGET 1000
+#endif
+
+// duration (ms) without traffic after which the link is considered idle
+#ifndef ESPCONNECT_POWER_IDLE_TIME
+  #define ESPCONNECT_POWER_IDLE_TIME 2000
+#endif
+
+// number of STA frames per power control period (500 ms) counted as traffic, in addition to markActivity()
+#ifndef ESPCONNECT_POWER_ACTIVITY_PACKETS
+  #define ESPCONNECT_POWER_ACTIVITY_PACKETS 4
+#endif
+
+// interval (ms) between two samples of the traffic counters
+#ifndef ESPCONNECT_TRAFFIC_SAMPLE_INTERVAL
+  #define ESPCONNECT_TRAFFIC_SAMPLE_INTERVAL 5000
+#endif
+
+// worst case wake-up latency (ms) of the modem sleep modes: about 1 DTIM period for MIN_MODEM, the listen interval for MAX_MODEM
+#ifndef ESPCONNECT_MIN_MODEM_LATENCY
+  #define ESPCONNECT_MIN_MODEM_LATENCY 300
+#endif
+#ifndef ESPCONNECT_MAX_MODEM_LATENCY
+  #define ESPCONNECT_MAX_MODEM_LATENCY 1000
+#endif
+
 namespace Soylent {
   class ESPConnect {
+      // examples/Benchmark: measures the internals and checks the PMK derivation against its known answer
+      friend struct ESPConnectBenchmark;
+
     public:
       enum class State {
         // end() => NETWORK_DISABLED
@@ -38,11 +219,14 @@ namespace Soylent {
         // NETWORK_CONNECTING => NETWORK_TIMEOUT
         NETWORK_TIMEOUT,
         // NETWORK_CONNECTING => NETWORK_CONNECTED
+        // NETWORK_DISCONNECTED => NETWORK_CONNECTED (fast reconnect, i.e. after roaming)
         // NETWORK_RECONNECTING => NETWORK_CONNECTED
+        // PORTAL_STARTED => NETWORK_CONNECTED (background retry)
         NETWORK_CONNECTED, // final state
         // NETWORK_CONNECTED => NETWORK_DISCONNECTED
         NETWORK_DISCONNECTED,
         // NETWORK_DISCONNECTED => NETWORK_RECONNECTING
+        // (with ESPCONNECT_ETH_SUPPORT, NETWORK_RECONNECTING => NETWORK_CONNECTED immediately when another interface still has an IP)
         NETWORK_RECONNECTING,
 
         // NETWORK_ENABLED => AP_STARTING
@@ -66,11 +250,37 @@ namespace Soylent {
         // wifi ap
         AP,
         // wifi sta
-        STA
+        STA,
+        // ethernet (requires ESPCONNECT_ETH_SUPPORT)
+        ETH
+      };
+
+      enum class PowerProfile {
+        // no modem sleep (default)
+        LATENCY = 0,
+        // no modem sleep while there is traffic, MIN_MODEM when idle
+        BALANCED,
+        // MIN_MODEM while there is traffic, deepest modem sleep allowed by the latency budget when idle
+        LOW_POWER
+      };
+
+      // check done once connected before the network is reported as ready
+      enum class ReadinessProbe {
+        // ready as soon as connected (default)
+        NONE = 0,
+        // ICMP echo to the gateway
+        GATEWAY,
+        // DNS query of a hostname
+        DNS,
+        // TCP connection to a host and port
+        TCP
       };
 
       typedef std::function<void(State previous, State state)> StateCallback;
 
+      // millisecond clock, wrapping at 2^32
+      typedef std::function<uint32_t()> ClockSource;
+
       typedef struct {
           // Static IP address to use when connecting to WiFi (STA mode)
           // If not set, DHCP will be used
@@ -81,6 +291,62 @@ namespace Soylent {
           IPAddress dns;
       } IPConfig;
 
+      typedef struct {
+          // number of RSSI samples currently in the window
+          uint16_t samples;
+          // exponentially weighted moving average of the RSSI (alpha = 1/8)
+          int8_t ewma;
+          // min, max and percentiles of the RSSI samples in the window
+          int8_t min;
+          int8_t max;
+          int8_t p10;
+          int8_t p50;
+          int8_t p90;
+          // signal quality (percentage from 0 to 100) of the averaged RSSI
+          int8_t quality;
+          // number of WiFi disconnections during the last hour (at most ESPCONNECT_DISCONNECT_HISTORY)
+          uint8_t disconnectRate;
+      } LinkStats;
+
+      // traffic of a network interface, counted by wrapping its lwIP input and output functions
+      typedef struct {
+          // totals since the interface was first connected
+          uint32_t rxBytes;
+          uint32_t txBytes;
+          uint32_t rxPackets;
+          uint32_t txPackets;
+          // frames refused by the stack (rx) or by the driver (tx)
+          uint32_t rxDrops;
+          uint32_t txDrops;
+          // rates (per second) over the last sample interval
+          uint32_t rxBytesRate;
+          uint32_t txBytesRate;
+          uint32_t rxPacketsRate;
+          uint32_t txPacketsRate;
+          // dropped frames (per thousand) over the last sample interval
+          uint16_t rxDropRate;
+          uint16_t txDropRate;
+      } TrafficStats;
+
+      // heap and stack figures sampled on state transitions and in the portal handlers
+      typedef struct {
+          uint32_t samples;
+          // free internal heap (bytes)
+          uint32_t heapFreeMin;
+          uint32_t heapFreeMax;
+          // lowest free internal heap ever reached (bytes)
+          uint32_t heapLowest;
+          // free PSRAM (bytes), 0 without PSRAM
+          uint32_t psramFreeMin;
+          uint32_t psramFreeMax;
+          // lowest stack high-water mark (bytes) of each sampling task, 0 if not sampled in this state:
+          // the task running the state machine (the loop() caller or the ESPConnect task),
+          // the WiFi event task (events are handled there without task mode) and the async_tcp task (portal handlers)
+          uint32_t stackFreeLoop;
+          uint32_t stackFreeEvents;
+          uint32_t stackFreeHttpd;
+      } MemoryStats;
+
       typedef struct {
           // SSID name to connect to, loaded from config or set from begin(), or from the captive portal
           std::string wifiSSID;
@@ -91,8 +357,8 @@ namespace Soylent {
       } Config;
 
     public:
-      explicit ESPConnect(AsyncWebServer& httpd) : _httpd(&httpd) {}
-      ~ESPConnect() { end(); }
+      explicit ESPConnect(AsyncWebServer& httpd);
+      ~ESPConnect();
 
       // Start ESPConnect:
       //
@@ -120,7 +386,11 @@ namespace Soylent {
       void end();
 
       // Listen for network state change
-      void listen(StateCallback callback) { _callback = callback; }
+      void listen(StateCallback callback);
+
+      // Replace the clock used by all ESPConnect timers (default: millis()), i.e. to run the state machine under a simulated clock.
+      // Must be called before begin().
+      void setClock(ClockSource clock);
 
       // Returns the current network state
       State getState() const { return _state; }
@@ -128,7 +398,8 @@ namespace Soylent {
       const char* getStateName() const;
       const char* getStateName(State state) const;
 
-      // returns the current default mode of the ESP (STA, AP).
+      // returns the current default mode of the ESP (ETH, STA, AP).
+      // When several interfaces have an IP, the highest priority one is returned: ETH first, then STA.
       Mode getMode() const;
 
       bool isConnected() const { return getIPAddress()[0] != 0; }
@@ -136,7 +407,7 @@ namespace Soylent {
       std::string getMACAddress() const { return getMACAddress(getMode()); }
       std::string getMACAddress(Mode mode) const;
 
-      // Returns the IP address of the current WiFi, or IP address of the AP or captive portal, or empty if not available
+      // Returns the IP address of the current Ethernet or WiFi, or IP address of the AP or captive portal, or empty if not available
       IPAddress getIPAddress() const { return getIPAddress(getMode()); }
       IPAddress getIPAddress(Mode mode) const;
 
@@ -148,6 +419,30 @@ namespace Soylent {
       int8_t getWiFiRSSI() const;
       // Returns the signal quality (percentage from 0 to 100) of the current WiFi, or -1 if not available
       int8_t getWiFiSignalQuality() const;
+      // Returns the smoothed statistics of the WiFi link, sampled in the background while connected in STA mode
+      LinkStats getLinkStats() const;
+
+      // Memory watermarks sampled while in the given state
+      MemoryStats getMemoryStats(State state) const;
+      // Largest amount of heap (bytes) taken by a single portal request handler while in PORTAL_STARTED
+      uint32_t getPortalPeakAllocation() const;
+
+      // Traffic counters and rates of the STA or ETH interface, sampled in the background while connected
+      TrafficStats getTrafficStats(Mode mode) const;
+      // Number of TCP segments retransmitted since boot, 0 if lwIP is built without TCP statistics
+      uint32_t getTCPRetransmits() const { return _tcpRetransmits; }
+      // Retransmitted TCP segments (per thousand sent segments) over the last sample interval
+      uint16_t getTCPRetransmitRate() const { return _tcpRetransmitRate; }
+
+      // Interval (ms) between two samples of the traffic counters
+      uint32_t getTrafficSampleInterval() const { return _trafficSampleInterval; }
+      // Interval (ms) between two samples of the traffic counters
+      void setTrafficSampleInterval(uint32_t interval) { _trafficSampleInterval = interval; }
+
+      // Interval (ms) between two RSSI samples of the link statistics
+      uint32_t getLinkSampleInterval() const { return _linkSampleInterval; }
+      // Interval (ms) between two RSSI samples of the link statistics
+      void setLinkSampleInterval(uint32_t interval) { _linkSampleInterval = interval; }
 
       // the hostname passed from begin()
       const std::string& getHostname() const { return _hostname; }
@@ -157,20 +452,23 @@ namespace Soylent {
       // Password used for the captive portal or in AP mode
       const std::string& getAccessPointPassword() const { return _apPassword; }
 
-      // Returns the current configuration loaded or passed from begin() or from captive portal
-      const Config& getConfig() const { return _config; }
+      // Returns the current configuration loaded or passed from begin() or from captive portal.
+      // The configuration getters return a copy of the last published snapshot: they can be called from any task without locking.
+      Config getConfig() const;
       // SSID name to connect to, loaded from config or set from begin(), or from the captive portal
-      const std::string& getConfiguredWiFiSSID() const { return _config.wifiSSID; }
+      std::string getConfiguredWiFiSSID() const { return getConfig().wifiSSID; }
       // Password for the WiFi to connect to, loaded from config or set from begin(), or from the captive portal
-      const std::string& getConfiguredWiFiPassword() const { return _config.wifiPassword; }
+      std::string getConfiguredWiFiPassword() const { return getConfig().wifiPassword; }
       // whether we need to set the ESP to stay in AP mode or not, loaded from config, begin(), or from captive portal
-      bool hasConfiguredAPMode() const { return _config.apMode; }
+      bool hasConfiguredAPMode() const { return getConfig().apMode; }
+      // Incremented each time a new configuration or IP configuration is published
+      uint32_t getConfigVersion() const { return _configVersion.load(); }
 
       // IP configuration used for WiFi
-      const IPConfig& getIPConfig() const { return _ipConfig; }
+      IPConfig getIPConfig() const;
       // Static IP configuration: by default, DHCP is used
       // The static IP configuration applies to the WiFi STA connection.
-      void setIPConfig(const IPConfig& ipConfig) { _ipConfig = ipConfig; }
+      void setIPConfig(const IPConfig& ipConfig);
 
       // Maximum duration that the captive portal will be active before closing
       uint32_t getCaptivePortalTimeout() const { return _portalTimeout; }
@@ -187,49 +485,542 @@ namespace Soylent {
       // Whether ESPConnect will block in the begin() method until the network is ready or not (old behaviour)
       void setBlocking(bool blocking) { _blocking = blocking; }
 
+      // Whether ESPConnect runs in its own FreeRTOS task instead of the application calling loop() (default: false)
+      bool isTaskMode() const { return _taskMode; }
+      // Whether ESPConnect runs in its own FreeRTOS task instead of the application calling loop() (default: false).
+      // To call before begin(). loop() then does nothing when called from another task.
+      void setTaskMode(bool taskMode, BaseType_t core = ESPCONNECT_TASK_CORE, UBaseType_t priority = ESPCONNECT_TASK_PRIORITY, uint32_t stackSize = ESPCONNECT_TASK_STACK_SIZE);
+
       // Whether ESPConnect will restart the ESP if the captive portal times out or once it has completed (old behaviour)
       bool isAutoRestart() const { return _autoRestart; }
       // Whether ESPConnect will restart the ESP if the captive portal times out or once it has completed (old behaviour)
       void setAutoRestart(bool autoRestart) { _autoRestart = autoRestart; }
 
+      // Limits applied to the captive portal requests: concurrent responses (503 above), and requests per second and burst per client IP (429 above)
+      void setPortalLimits(uint8_t maxInflight, uint8_t rate, uint8_t burst) {
+        _portalMaxInflight = maxInflight;
+        _portalRate = rate;
+        _portalBurst = burst;
+      }
+      // Number of captive portal requests rejected with 503 because too many responses were in flight
+      uint32_t getPortalBusyDrops() const { return _portalBusyDrops; }
+      // Number of captive portal requests rejected with 429 because the client exceeded its rate
+      uint32_t getPortalRateDrops() const { return _portalRateDrops; }
+
+      // Whether the soft AP is started on the least congested channel seen in the last scan (default: true)
+      bool isAPChannelSelection() const { return _apChannelSelection; }
+      // Whether the soft AP is started on the least congested channel seen in the last scan (default: true)
+      void setAPChannelSelection(bool selection) { _apChannelSelection = selection; }
+      // Whether the channel is re-evaluated every ESPCONNECT_AP_CHANNEL_INTERVAL seconds while no station is connected to the soft AP (default: false)
+      bool isAPChannelReevaluation() const { return _apChannelReevaluation; }
+      // Whether the channel is re-evaluated every ESPCONNECT_AP_CHANNEL_INTERVAL seconds while no station is connected to the soft AP (default: false)
+      void setAPChannelReevaluation(bool reevaluation) { _apChannelReevaluation = reevaluation; }
+      // Channel of the soft AP
+      uint8_t getAPChannel() const { return _apChannel; }
+      // Congestion score of the soft AP channel (lower is better, 0 if unknown)
+      uint32_t getAPChannelScore() const { return _apChannelScore; }
+
+      // Whether ESPConnect will move to a stronger access point of the same SSID while connected (default: false)
+      bool isRoaming() const { return _roaming; }
+      // Whether ESPConnect will move to a stronger access point of the same SSID while connected (default: false)
+      void setRoaming(bool roaming) { _roaming = roaming; }
+
+      // RSSI (dBm) below which ESPConnect starts background scans looking for a better access point
+      int8_t getRoamingThreshold() const { return _roamThreshold; }
+      // RSSI (dBm) below which ESPConnect starts background scans looking for a better access point
+      void setRoamingThreshold(int8_t rssi) { _roamThreshold = rssi; }
+
+      // Minimum RSSI gain (dB) required to move to another access point
+      uint8_t getRoamingHysteresis() const { return _roamHysteresis; }
+      // Minimum RSSI gain (dB) required to move to another access point
+      void setRoamingHysteresis(uint8_t db) { _roamHysteresis = db; }
+
+      // Minimum duration between two background scans
+      uint32_t getRoamingInterval() const { return _roamInterval; }
+      // Minimum duration between two background scans
+      void setRoamingInterval(uint32_t interval) { _roamInterval = interval; }
+
+      // Number of successful roams since begin()
+      uint32_t getRoamCount() const { return _roamCount; }
+      // Accumulated RSSI gain (dB) of all successful roams since begin()
+      int32_t getRoamGain() const { return _roamGain; }
+
+      // Power profile used to switch the modem sleep mode while connected in STA mode (default: LATENCY)
+      PowerProfile getPowerProfile() const { return _powerProfile; }
+      // Power profile used to switch the modem sleep mode while connected in STA mode (default: LATENCY)
+      void setPowerProfile(PowerProfile profile) { _powerProfile = profile; }
+
+      // Maximum wake-up latency (ms) accepted by the application: caps the modem sleep mode that can be used
+      uint32_t getLatencyBudget() const { return _latencyBudget; }
+      // Maximum wake-up latency (ms) accepted by the application: caps the modem sleep mode that can be used
+      void setLatencyBudget(uint32_t budget) { _latencyBudget = budget; }
+
+      // Report application traffic: keeps the modem awake for ESPCONNECT_POWER_IDLE_TIME ms
+      void markActivity() { _lastActivity = _now(); }
+
+      // Current modem sleep mode
+      wifi_ps_type_t getPowerMode() const { return _powerMode; }
+      // Time (ms) spent in the given modem sleep mode since begin()
+      uint32_t getPowerModeDuration(wifi_ps_type_t mode) const;
+
+      // Whether ESPConnect keeps trying to connect to the configured WiFi, with backoff, while the captive portal runs after a connect timeout.
+      // When the connection succeeds, the portal is closed and the state moves to NETWORK_CONNECTED without restart.
+      bool isBackgroundRetry() const { return _backgroundRetry; }
+      // Whether ESPConnect keeps trying to connect to the configured WiFi, with backoff, while the captive portal runs after a connect timeout.
+      // When the connection succeeds, the portal is closed and the state moves to NETWORK_CONNECTED without restart.
+      void setBackgroundRetry(bool backgroundRetry) { _backgroundRetry = backgroundRetry; }
+
+#ifdef ESPCONNECT_ETH_SUPPORT
+      // Whether ESPConnect starts Ethernet with ETH.begin() and the ETH_PHY_* defines (default: true).
+      // Set to false when the application calls ETH.begin() with its own PHY configuration: the interface is then only watched, and used right away if it already has an IP.
+      bool isEthernetAutoStart() const { return _ethAutoStart; }
+      // Whether ESPConnect starts Ethernet with ETH.begin() and the ETH_PHY_* defines (default: true).
+      // Set to false when the application calls ETH.begin() with its own PHY configuration: the interface is then only watched, and used right away if it already has an IP.
+      void setEthernetAutoStart(bool autoStart) { _ethAutoStart = autoStart; }
+#endif
+
+      // Whether the WPA2 PMK derived from the passphrase is stored (ESPConnect Preferences namespace) and used instead of the passphrase (default: false).
+      // This skips the PBKDF2 derivation done by the WiFi driver on each connection.
+      bool isPMKCache() const { return _pmkCache; }
+      // Whether the WPA2 PMK derived from the passphrase is stored (ESPConnect Preferences namespace) and used instead of the passphrase (default: false).
+      // This skips the PBKDF2 derivation done by the WiFi driver on each connection.
+      void setPMKCache(bool pmkCache) { _pmkCache = pmkCache; }
+
+      // Whether ESPConnect keeps the connection (SSID, PMK, BSSID, channel, DHCP lease) in RTC memory to reconnect faster after a deep sleep wake-up.
+      // On wake-up, NVS is only read once connected, the known access point is joined directly on its channel and the DHCP lease is reused as a static IP until its renewal time.
+      bool isFastWake() const { return _fastWake; }
+      // Whether ESPConnect keeps the connection (SSID, PMK, BSSID, channel, DHCP lease) in RTC memory to reconnect faster after a deep sleep wake-up.
+      // On wake-up, NVS is only read once connected, the known access point is joined directly on its channel and the DHCP lease is reused as a static IP until its renewal time.
+      void setFastWake(bool fastWake) { _fastWake = fastWake; }
+
+      // Probe run once connected, until it succeeds, before isNetworkReady() returns true (default: NONE).
+      // host is the hostname queried by DNS, or the host to connect to with TCP (with port).
+      void setReadinessProbe(ReadinessProbe probe, const char* host = nullptr, uint16_t port = 0);
+      // Whether the network is connected and the readiness probe succeeded: applications should wait for it before sending
+      bool isNetworkReady() const { return _networkReady; }
+      // Duration (ms) between NETWORK_CONNECTED and the network being ready
+      uint32_t getReadyDelay() const { return _readyDelay; }
+      // Round-trip time (ms) of the successful readiness probe of the current connection, 0 if none
+      uint32_t getReadinessProbeRTT() const { return _probeRTT; }
+
+      // Registers a hostname resolved in the background as soon as an IP is obtained, and kept in the DNS cache.
+      // Returns false if the cache is full or the hostname too long.
+      bool addDNSHostname(const char* hostname);
+      // Resolves a hostname from the DNS cache, or with a blocking lookup (also cached) if not cached or expired
+      bool resolve(const char* hostname, IPAddress& ip);
+      // Time to live (s) of the cached addresses (lwIP does not give the TTL of the DNS answers)
+      uint32_t getDNSCacheTTL() const { return _dnsTTL; }
+      // Time to live (s) of the cached addresses (lwIP does not give the TTL of the DNS answers)
+      void setDNSCacheTTL(uint32_t ttl) { _dnsTTL = ttl; }
+
+      // Registers a mDNS service (e.g. "http", "tcp", 80), published as long as the responder runs.
+      // The responder is started once by ESPConnect and re-announces on reconnect, so services never have to be added again.
+      void addMDNSService(const char* service, const char* proto, uint16_t port);
+      // Adds or updates a TXT record of a registered mDNS service
+      void addMDNSServiceTxt(const char* service, const char* proto, const char* key, const char* value);
+      void removeMDNSService(const char* service, const char* proto);
+
+#ifdef ESPCONNECT_TRACE
+      typedef std::function<void(uint32_t timeMs, State previous, State state)> ReplayCallback;
+
+      // Writes the trace of WiFi events, state changes and loop() cadence recorded since begin() (oldest first), returns the number of bytes written
+      size_t dumpTrace(Print& out) const;
+      void clearTrace();
+      // Replays a trace written by dumpTrace() from the start of begin(), on a virtual clock and without waiting,
+      // with the configuration recorded at begin(). Recorded WiFi events are fed to the state machine and loop() is called at the recorded cadence.
+      // The WiFi, Ethernet, mDNS, lwIP and web server calls are stubbed out during the replay. The callback gets each state change with its virtual time.
+      // Returns false if the trace is invalid.
+      bool replayTrace(const uint8_t* trace, size_t len, ReplayCallback callback = nullptr);
+#endif
+
       // when using auto-load and save of configuration, this method can clear saved states.
       void clearConfiguration();
 
       void toJson(const JsonObject& root) const;
 
+    private:
+      enum class Timer : uint8_t {
+        CONNECT_TIMEOUT = 0,
+        PORTAL_TIMEOUT,
+        LINK_SAMPLE,
+        ROAM,
+        ROAM_HOLDOFF,
+        POWER,
+        STA_RETRY,
+        FAST_WAKE,
+        READINESS,
+        AP_CHANNEL,
+        TRAFFIC,
+        SCAN_PREFETCH,
+        DHCP_RENEW,
+        COUNT
+      };
+
     private:
       AsyncWebServer* _httpd = nullptr;
       State _state = State::NETWORK_DISABLED;
       StateCallback _callback = nullptr;
       DNSServer* _dnsServer = nullptr;
-      int64_t _lastTime = -1;
+      ClockSource _clock = nullptr;
+      TimerWheel<static_cast<size_t>(Timer::COUNT)> _timers;
       std::string _hostname;
       std::string _apSSID;
       std::string _apPassword;
       uint32_t _connectTimeout = ESPCONNECT_CONNECTION_TIMEOUT;
       uint32_t _portalTimeout = ESPCONNECT_PORTAL_TIMEOUT;
+      // working copies, only changed by the state machine (or with the lock held in task mode), with _configMutex held
       Config _config;
       IPConfig _ipConfig;
+      // serializes the writers of the working copies and snapshots, in all modes
+      SemaphoreHandle_t _configMutex = nullptr;
+      // configuration posted to the captive portal, applied by loop(): the async_tcp task never writes the working copies
+      struct PortalConfig {
+          char ssid[33];
+          char password[65];
+          bool apMode;
+      };
+      PortalConfig _portalConfig = {};
+      std::atomic<bool> _portalConfigPending{false};
+      portMUX_TYPE _portalConfigLock = portMUX_INITIALIZER_UNLOCKED;
+      // immutable copies read by the getters: the slot being written is never the published one,
+      // and is only written once no reader holds it anymore
+      struct ConfigSnapshot {
+          Config config;
+          IPConfig ipConfig;
+      };
+      ConfigSnapshot _snapshots[2] = {};
+      std::atomic<uint8_t> _snapshot{0};
+      mutable std::atomic<uint8_t> _snapshotReaders[2] = {};
+      std::atomic<uint32_t> _configVersion{0};
       WiFiEventId_t _wifiEventListenerId = 0;
       bool _blocking = true;
+      bool _taskMode = false;
+      BaseType_t _taskCore = ESPCONNECT_TASK_CORE;
+      UBaseType_t _taskPriority = ESPCONNECT_TASK_PRIORITY;
+      uint32_t _taskStackSize = ESPCONNECT_TASK_STACK_SIZE;
+      std::atomic<TaskHandle_t> _task{nullptr};
+      std::atomic<bool> _taskStop{false};
+      // WiFi events handed over from the event task to the ESPConnect task
+      std::atomic<QueueHandle_t> _events{nullptr};
+      // task mode: serializes the state machine and the API calls of the other tasks, from begin() until the task has exited
+      SemaphoreHandle_t _mutex = nullptr;
+      // holds the mutex in task mode, does nothing otherwise. Also holds any other recursive mutex, i.e. _configMutex
+      struct Lock {
+          explicit Lock(const ESPConnect* espConnect);
+          explicit Lock(SemaphoreHandle_t mutex);
+          ~Lock();
+          SemaphoreHandle_t mutex;
+      };
       bool _autoRestart = true;
       bool _autoSave = false;
+      bool _backgroundRetry = false;
+      bool _fastWake = false;
+      bool _pmkCache = false;
+      // 64 hex digits PSK, empty if unknown
+      std::string _pmk;
+      // derivation done or not needed for the current credentials
+      bool _pmkDerived = false;
+      // derivation running in its own task, without the lock: the task hands the job back to loop(), which publishes the PMK
+      struct PMKJob {
+          Soylent::ESPConnect* self;
+          std::string ssid;
+          std::string password;
+          std::string pmk;
+          bool derived;
+      };
+      std::atomic<bool> _pmkDeriving{false};
+      std::atomic<PMKJob*> _pmkJob{nullptr};
+      uint8_t _portalMaxInflight = ESPCONNECT_PORTAL_MAX_INFLIGHT;
+      uint8_t _portalRate = ESPCONNECT_PORTAL_RATE;
+      uint8_t _portalBurst = ESPCONNECT_PORTAL_BURST;
+      // only updated from the async_tcp task
+      uint8_t _portalInflight = 0;
+      uint32_t _portalBusyDrops = 0;
+      uint32_t _portalRateDrops = 0;
+      struct PortalClient {
+          uint32_t ip;
+          uint32_t lastMs;
+          // 1/1000 token
+          uint32_t tokens;
+      };
+      PortalClient _portalClients[ESPCONNECT_PORTAL_CLIENTS] = {};
+      MemoryStats _memoryStats[static_cast<size_t>(State::PORTAL_TIMEOUT) + 1] = {};
+      // sampled from loop(), the WiFi event task and the async_tcp task
+      mutable portMUX_TYPE _memoryLock = portMUX_INITIALIZER_UNLOCKED;
+      // task delivering the WiFi events, to tell its stack samples apart
+      std::atomic<TaskHandle_t> _eventTask{nullptr};
+      uint32_t _portalPeakAllocation = 0;
+      // samples memory when a portal handler returns
+      struct HandlerProbe {
+          explicit HandlerProbe(ESPConnect* espConnect);
+          ~HandlerProbe();
+          ESPConnect* espConnect;
+          uint32_t heapBefore;
+      };
+#ifdef ESPCONNECT_TRACE
+      enum class TraceType : uint8_t {
+        // no event: time gap longer than a record can hold
+        GAP = 0,
+        // arg: WiFi event
+        EVENT,
+        // arg: new state
+        STATE,
+        // arg: number of loop() calls since the previous record
+        LOOP,
+      };
+      struct TraceRecord {
+          // time (ms) since the previous record
+          uint16_t delta;
+          TraceType type;
+          uint8_t arg;
+      };
+      TraceRecord _traceRecords[ESPCONNECT_TRACE_SIZE];
+      // next record to write
+      size_t _traceHead = 0;
+      size_t _traceCount = 0;
+      uint32_t _traceLast = 0;
+      uint8_t _traceLoops = 0;
+      // configuration at begin(), written before the records: a replay runs with it
+      struct TraceHeader {
+          static constexpr uint32_t AP_MODE = 1;
+          static constexpr uint32_t WIFI_SSID = 2;
+          static constexpr uint32_t BACKGROUND_RETRY = 4;
+          uint32_t flags;
+          // connect and portal timeouts (s)
+          uint16_t connectTimeout;
+          uint16_t portalTimeout;
+      };
+      TraceHeader _traceHeader = {};
+      bool _replaying = false;
+      ReplayCallback _replayCallback = nullptr;
+      // interfaces (bit 1 << Mode) having an IP in the replayed trace
+      uint8_t _replayIPs = 0;
+      // written from both the WiFi event task and loop()
+      mutable portMUX_TYPE _traceLock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+      struct DNSCacheEntry {
+          enum class Status : uint8_t {
+            FREE = 0,
+            // registered, never resolved or lookup failed
+            UNRESOLVED,
+            // lookup in progress in the lwIP thread
+            PENDING,
+            // resolved in the lwIP thread, expiry not set yet
+            FRESH,
+            RESOLVED,
+          };
+          char hostname[ESPCONNECT_DNS_HOSTNAME_LENGTH];
+          uint32_t ip;
+          // time (ms) at which the address expires
+          uint32_t expires;
+          Status status;
+      };
+      DNSCacheEntry _dnsCache[ESPCONNECT_DNS_CACHE_SIZE] = {};
+      uint32_t _dnsTTL = ESPCONNECT_DNS_TTL;
+      enum class ProbeStatus : uint8_t {
+        IDLE = 0,
+        RUNNING,
+        PASSED,
+      };
+      ReadinessProbe _readinessProbe = ReadinessProbe::NONE;
+      std::string _readinessHost;
+      uint16_t _readinessPort = 0;
+      bool _networkReady = false;
+      uint32_t _connectedSince = 0;
+      uint32_t _readyDelay = 0;
+      // probe callbacks run in the ping, lwIP or async_tcp tasks
+      std::atomic<ProbeStatus> _probeStatus{ProbeStatus::IDLE};
+      uint32_t _probeStart = 0;
+      uint32_t _probeRTT = 0;
+      void* _pingSession = nullptr;
+      AsyncClient* _probeClient = nullptr;
+      bool _apChannelSelection = true;
+      bool _apChannelReevaluation = false;
+      uint8_t _apChannel = 1;
+      uint32_t _apChannelScore = 0;
+      // the re-evaluation scan switched the soft AP from WIFI_AP to WIFI_AP_STA
+      bool _apScanEnabledSTA = false;
+      // congestion score of channels 1 to ESPCONNECT_AP_MAX_CHANNEL, from the last scan
+      uint32_t _channelScores[ESPCONNECT_AP_MAX_CHANNEL] = {};
+      bool _channelsScored = false;
+      // strongest access points of the last finished scan, listed by the captive portal
+      struct ScanEntry {
+          char ssid[33];
+          int8_t rssi;
+          uint8_t channel;
+          bool open;
+      };
+      // written by the state machine under _scanCacheLock, copied by the portal handlers
+      ScanEntry _scanCache[ESPCONNECT_SCAN_CACHE_SIZE] = {};
+      uint8_t _scanCacheCount = 0;
+      uint32_t _scanCachedAt = 0;
+      bool _scanCached = false;
+      mutable portMUX_TYPE _scanCacheLock = portMUX_INITIALIZER_UNLOCKED;
+      // set by the scan handler: loop() caches the finished scan or starts a new one
+      std::atomic<bool> _scanRequested{false};
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+      // portal objects owned by ESPConnect, kept in the instance instead of being allocated on each portal.
+      // The web server still allocates the requests and responses: the portal does not run without heap.
+      // storage of the captive portal DNS server, constructed in place by _startAP()
+      alignas(DNSServer) uint8_t _dnsServerStorage[sizeof(DNSServer)];
+      // body of the scan response: at most 128 bytes per access point
+      char _scanResponse[ESPCONNECT_SCAN_CACHE_SIZE * 128 + 2];
+      // the body is read while the response is sent: concurrent scan responses fall back to an allocated JSON response
+      bool _scanResponseBusy = false;
+#endif
+      bool _mdnsStarted = false;
+      // last state and mode published in the TXT records of the _espconnect._tcp service
+      const char* _mdnsState = nullptr;
+      const char* _mdnsMode = nullptr;
+      struct MDNSService {
+          std::string service;
+          std::string proto;
+          uint16_t port;
+          std::vector<std::pair<std::string, std::string>> txt;
+      };
+      std::vector<MDNSService> _mdnsServices;
+      // connecting with the connection retained in RTC memory
+      bool _fastPath = false;
+      // connected with the retained PMK: the config is loaded from NVS in loop()
+      bool _configDeferred = false;
+      // DHCP lease retained in RTC memory applied as a static IP, until its renewal time
+      bool _leaseReused = false;
+      // current backoff (seconds) of the background retry
+      uint32_t _retryBackoff = ESPCONNECT_RETRY_BACKOFF_MIN;
+      // interface that got an IP while the portal was running: set from the WiFi event, handled in loop()
+      Mode _retryMode = Mode::NONE;
       AsyncCallbackWebHandler* _scanHandler = nullptr;
       AsyncCallbackWebHandler* _connectHandler = nullptr;
       AsyncCallbackWebHandler* _homeHandler = nullptr;
+      bool _captivePortalEnabled = false;
+      // interface currently carrying the NETWORK_CONNECTED state
+      Mode _activeMode = Mode::NONE;
+#ifdef ESPCONNECT_ETH_SUPPORT
+      bool _ethStarted = false;
+      bool _ethAutoStart = true;
+#endif
+      bool _roaming = false;
+      int8_t _roamThreshold = ESPCONNECT_ROAMING_RSSI_THRESHOLD;
+      uint8_t _roamHysteresis = ESPCONNECT_ROAMING_HYSTERESIS;
+      uint32_t _roamInterval = ESPCONNECT_ROAMING_INTERVAL;
+      bool _roamScanning = false;
+      // a roam locks the STA config to a BSSID: unlock it on the next unexpected disconnection
+      bool _roamPinned = false;
+      // the disconnection caused by a roam must not trigger a reconnect
+      bool _roamSkipReconnect = false;
+      int8_t _roamPendingGain = 0;
+      uint32_t _roamCount = 0;
+      int32_t _roamGain = 0;
+      LinkStats _linkStats = {};
+      uint32_t _linkSampleInterval = ESPCONNECT_RSSI_SAMPLE_INTERVAL;
+      int8_t _rssiWindow[ESPCONNECT_RSSI_WINDOW] = {};
+      uint16_t _rssiHead = 0;
+      // EWMA in 1/16 dBm
+      int16_t _rssiEwma = 0;
+      uint32_t _disconnectTimes[ESPCONNECT_DISCONNECT_HISTORY] = {};
+      uint8_t _disconnectCount = 0;
+      uint8_t _disconnectHead = 0;
+      PowerProfile _powerProfile = PowerProfile::LATENCY;
+      uint32_t _latencyBudget = ESPCONNECT_LATENCY_BUDGET;
+      wifi_ps_type_t _powerMode = WIFI_PS_NONE;
+      uint32_t _powerModeSince = 0;
+      uint32_t _powerModeDurations[3] = {0, 0, 0};
+      uint32_t _lastActivity = 0;
+      // STA frames counted at the previous power control period
+      uint32_t _powerPackets = 0;
+      // index 0: STA, 1: ETH
+      TrafficStats _trafficStats[2] = {};
+      uint32_t _trafficSampleInterval = ESPCONNECT_TRAFFIC_SAMPLE_INTERVAL;
+      uint32_t _trafficSampled = 0;
+      uint32_t _tcpRetransmits = 0;
+      uint16_t _tcpRetransmitRate = 0;
+      // raw lwIP counters at the previous sample
+      uint32_t _tcpRexmitLast = 0;
+      uint32_t _tcpXmitLast = 0;
 
     private:
       void _setState(State state);
+      void _wake();
+      static void _runTask(void* arg);
+      // WPA2 PMK: PBKDF2-HMAC-SHA1(passphrase, ssid, 4096 iterations, 32 bytes), as 64 hex digits
+      static bool _derivePMK(const std::string& ssid, const std::string& password, std::string& pmk);
+      static void _derivePMKTask(void* arg);
+      void _deleteMutex();
+#ifdef ESPCONNECT_TRACE
+      void _record(TraceType type, uint8_t arg);
+#endif
       void _startSTA();
       void _startAP();
       void _stopAP();
       void _enableCaptivePortal();
       void _disableCaptivePortal();
+      void _removePortalHandlers();
+      void _teardown();
       void _onWiFiEvent(WiFiEvent_t event);
-      bool _durationPassed(uint32_t intervalSec);
+      void _publishConfig();
+      const ConfigSnapshot& _acquireSnapshot(uint8_t& slot) const;
+      void _releaseSnapshot(uint8_t slot) const { _snapshotReaders[slot]--; }
+      uint32_t _now() const { return _clock ? _clock() : millis(); }
+      void _schedule(Timer timer, uint32_t delayMs) { _timers.schedule(static_cast<size_t>(timer), delayMs); }
+      void _cancel(Timer timer) { _timers.cancel(static_cast<size_t>(timer)); }
+      bool _isScheduled(Timer timer) const { return _timers.isArmed(static_cast<size_t>(timer)); }
+      void _onTimer(Timer timer);
       void _scan();
-
-    private:
+      void _cacheScan();
+      // copies the scan cache, returns the number of entries, or -1 if there is none
+      int _copyScanCache(ScanEntry* entries, uint32_t& cachedAt) const;
+      // writes the access points as listed by the captive portal (/espconnect/scan)
+      static void _scanToJson(const JsonArray& root, const ScanEntry* entries, uint8_t count);
+      // parses the form posted to /espconnect/connect, returns the JSON error message sent back, or nullptr if it is valid
+      static const char* _parsePortalForm(const char* apMode, const char* ssid, const char* password, PortalConfig& config);
+      // response serving the captive portal page, owned by the caller until sent
+      static std::unique_ptr<AsyncWebServerResponse> _beginPortalPage();
+      // signal quality (percentage from 0 to 100) of a RSSI
       static int8_t _wifiSignalQuality(int32_t rssi);
+#ifdef ESPCONNECT_STATIC_PORTAL_OBJECTS
+      size_t _writeScanResponse(const ScanEntry* entries, uint8_t count);
+#endif
+      // passphrase or PMK given to the WiFi driver
+      const char* _psk() const { return _pmk.empty() ? _config.wifiPassword.c_str() : _pmk.c_str(); }
+      void _softAP();
+      void _scoreChannels();
+      uint8_t _bestChannel() const;
+      void _saveWakeCache();
+      void _loadDeferredConfig();
+      void _startMDNS();
+      void _startProbe();
+      void _stopProbe();
+      void _probePassed();
+      static void _probeDNS(void* ctx);
+      void _warmDNSCache();
+      void _updateDNSCache();
+      DNSCacheEntry* _findDNSEntry(const char* hostname);
+      static void _lookupDNSEntries(void* ctx);
+      static void _onDNSFound(const char* name, const ip_addr_t* addr, void* arg);
+      void _sampleMemory(State state, bool portalHandler = false);
+      bool _admitPortalRequest(AsyncWebServerRequest* request);
+      bool _takePortalToken(uint32_t ip);
+      void _updateMDNS();
+      MDNSService* _findMDNSService(const char* service, const char* proto);
+      bool _isRetrying() const { return _backgroundRetry && !_config.apMode && !_config.wifiSSID.empty(); }
+#ifdef ESPCONNECT_TRACE
+      // while a trace is replayed, the WiFi, Ethernet, mDNS, lwIP and web server calls are stubbed out: only the state machine runs
+      bool _isReplaying() const { return _replaying; }
+#else
+      bool _isReplaying() const { return false; }
+#endif
+      bool _hasIP(Mode mode) const;
+      Mode _failoverMode() const;
+      void _switchActiveMode(Mode mode);
+#ifdef ESPCONNECT_ETH_SUPPORT
+      void _startEthernet();
+#endif
+      void _roam();
+      void _sampleLink();
+      void _recordDisconnect();
+      void _updateDisconnectRate();
+      void _adaptPower();
+      void _sampleTraffic();
+      void _setPowerMode(wifi_ps_type_t mode);
   };
 } // namespace Soylent
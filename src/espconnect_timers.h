@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2025 Robert Wendlandt
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// duration (ms) of one tick of the timer wheel
+#ifndef ESPCONNECT_TIMER_TICK
+  #define ESPCONNECT_TIMER_TICK 10
+#endif
+
+namespace Soylent {
+  // Hierarchical timer wheel holding a fixed set of N timers, identified by their index.
+  //
+  // 4 levels of 64 slots: with a 10 ms tick, level 0 covers 640 ms and level 3 about 46 hours.
+  // schedule() and cancel() are O(1). advance() is O(1) per elapsed tick plus the expired timers,
+  // and only moves the tick counter when no timer is armed. msUntilNext() is O(N).
+  //
+  // Times are passed in by the caller (uint32_t milliseconds, wrap-safe) so that any clock source can be used.
+  template <size_t N>
+  class TimerWheel {
+      static_assert(N < 255, "TimerWheel supports at most 254 timers");
+
+    public:
+      TimerWheel() { reset(0); }
+
+      // Cancels all timers and restarts counting from nowMs
+      void reset(uint32_t nowMs) {
+        for (size_t level = 0; level < LEVELS; level++)
+          for (size_t slot = 0; slot < SLOTS; slot++)
+            _slots[level][slot] = NIL;
+        for (size_t id = 0; id < N; id++)
+          _nodes[id].armed = false;
+        _expiring = NIL;
+        _armed = 0;
+        _current = 0;
+        _lastMs = nowMs;
+      }
+
+      // Arms (or re-arms) the timer to expire in delayMs, rounded up to the next tick
+      void schedule(size_t id, uint32_t delayMs) {
+        cancel(id);
+        uint32_t ticks = (delayMs + ESPCONNECT_TIMER_TICK - 1) / ESPCONNECT_TIMER_TICK;
+        if (ticks > MAX_TICKS)
+          ticks = MAX_TICKS;
+        _nodes[id].expires = _current + ticks;
+        _insert(id);
+        _armed++;
+      }
+
+      void cancel(size_t id) {
+        if (!_nodes[id].armed)
+          return;
+        _unlink(id);
+        _armed--;
+      }
+
+      bool isArmed(size_t id) const { return _nodes[id].armed; }
+
+      // Returns the duration (ms) from nowMs until the next timer expires, 0 if one is already due, or UINT32_MAX if no timer is armed.
+      // The expiry times are read from the armed timers, so that a timer waiting in a higher level is not missed.
+      uint32_t msUntilNext(uint32_t nowMs) const {
+        if (_armed == 0)
+          return UINT32_MAX;
+        uint32_t ticks = MAX_TICKS;
+        for (size_t id = 0; id < N; id++) {
+          if (!_nodes[id].armed)
+            continue;
+          const int32_t delta = static_cast<int32_t>(_nodes[id].expires - _current);
+          // expired timer of the slot being processed
+          if (delta < 0)
+            return 0;
+          if (static_cast<uint32_t>(delta) < ticks)
+            ticks = delta;
+        }
+        // the tick _current is processed once nowMs reaches _lastMs + ESPCONNECT_TIMER_TICK
+        const uint32_t due = (ticks + 1) * ESPCONNECT_TIMER_TICK;
+        const uint32_t elapsed = nowMs - _lastMs;
+        return elapsed >= due ? 0 : due - elapsed;
+      }
+
+      // Moves time forward to nowMs and calls onExpire(id) for each expired timer.
+      // The callback can schedule or cancel any timer, including the expired one.
+      template <typename F>
+      void advance(uint32_t nowMs, F&& onExpire) {
+        uint32_t ticks = (nowMs - _lastMs) / ESPCONNECT_TIMER_TICK;
+        if (ticks == 0)
+          return;
+        _lastMs += ticks * ESPCONNECT_TIMER_TICK;
+        while (ticks > 0) {
+          if (_armed == 0) {
+            _current += ticks;
+            return;
+          }
+          _tick(onExpire);
+          ticks--;
+        }
+      }
+
+    private:
+      static constexpr size_t LEVELS = 4;
+      static constexpr uint32_t BITS = 6;
+      static constexpr uint32_t SLOTS = 1 << BITS;
+      static constexpr uint32_t MASK = SLOTS - 1;
+      static constexpr uint32_t MAX_TICKS = (1UL << (LEVELS * BITS)) - 1;
+      static constexpr uint8_t NIL = 0xFF;
+
+      struct Node {
+          uint32_t expires;
+          uint8_t next;
+          uint8_t prev;
+          uint8_t level;
+          uint8_t slot;
+          bool armed;
+      };
+
+      Node _nodes[N];
+      uint8_t _slots[LEVELS][SLOTS];
+      // timers of the slot being expired, kept apart so that the callback never sees them re-scheduled in the same slot
+      uint8_t _expiring;
+      size_t _armed;
+      // next tick to process
+      uint32_t _current;
+      // time of the last processed tick
+      uint32_t _lastMs;
+
+      void _insert(size_t id) {
+        Node& node = _nodes[id];
+        uint32_t delta = node.expires - _current;
+        // already expired: fire on next tick
+        if (static_cast<int32_t>(delta) < 0) {
+          node.expires = _current;
+          delta = 0;
+        }
+        uint8_t level = 0;
+        while (level < LEVELS - 1 && delta >= (1UL << ((level + 1) * BITS)))
+          level++;
+        node.level = level;
+        node.slot = (node.expires >> (level * BITS)) & MASK;
+        node.prev = NIL;
+        node.next = _slots[level][node.slot];
+        if (node.next != NIL)
+          _nodes[node.next].prev = id;
+        _slots[level][node.slot] = id;
+        node.armed = true;
+      }
+
+      void _unlink(size_t id) {
+        Node& node = _nodes[id];
+        if (node.prev != NIL)
+          _nodes[node.prev].next = node.next;
+        else if (node.level == LEVELS)
+          _expiring = node.next;
+        else
+          _slots[node.level][node.slot] = node.next;
+        if (node.next != NIL)
+          _nodes[node.next].prev = node.prev;
+        node.armed = false;
+      }
+
+      // moves all timers of a slot of a higher level to the lower levels
+      void _cascade(size_t level, uint32_t slot) {
+        uint8_t id = _slots[level][slot];
+        _slots[level][slot] = NIL;
+        while (id != NIL) {
+          const uint8_t next = _nodes[id].next;
+          _insert(id);
+          id = next;
+        }
+      }
+
+      template <typename F>
+      void _tick(F& onExpire) {
+        const uint32_t index = _current & MASK;
+        if (index == 0) {
+          for (size_t level = 1; level < LEVELS; level++) {
+            const uint32_t slot = (_current >> (level * BITS)) & MASK;
+            _cascade(level, slot);
+            if (slot != 0)
+              break;
+          }
+        }
+        _expiring = _slots[0][index];
+        _slots[0][index] = NIL;
+        for (uint8_t id = _expiring; id != NIL; id = _nodes[id].next)
+          _nodes[id].level = LEVELS;
+        _current++;
+        while (_expiring != NIL) {
+          const uint8_t id = _expiring;
+          _unlink(id);
+          _armed--;
+          onExpire(id);
+        }
+      }
+  };
+} // namespace Soylent